@@ -19,18 +19,27 @@ Programmed by Alexey Pechnikov (pechnikov@mobigroup.ru) for SQLite
 /* You should have received a copy of the GNU General Public License     */
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
+#define _GNU_SOURCE           /* For asprintf */
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include "sqlite3-dbf.h"
 
@@ -39,6 +48,9 @@ int main(int argc, char **argv)
     /* Describing the DBF file */
     char          *dbffilename;
     FILE          *dbffile;
+    const char    *dbfdecompressor; /* gzip or zstd, if the file is packed */
+    pid_t          dbfdecompressorpid = 0;
+    long           dbfoffset;
     DBFHEADER      dbfheader;
     DBFFIELD      *fields;
     PGFIELD       *pgfields;
@@ -57,35 +69,81 @@ int main(int argc, char **argv)
 
     /* Describing the memo file */
     char        *memofilename = NULL;
-    int          memofd;
+    int          memofd = -1;
     struct stat  memostat;
-    int32_t      memoblocknumber;
+    const char  *memodecompressor;
+    int          memotable = MEMOTABLENONE;
+    MEMOSTREAM  *memostream = NULL; /* For memo files that can't be mapped */
+    MEMOCHUNKS  *memochunks = NULL; /* For memo files that may not be */
+    const char  *memoheader;
+    size_t       memoheadersize;
 
     void        *memomap = NULL; /* Pointer to the mmap of the memo file */
-    char        *memorecord;	 /* Pointer to the current memo block */
+    size_t       memosize = 0;
     size_t       memoblocksize = 0;  /* The length of each memo block */
 
     /* Processing and misc */
+    DBFTABLE   table;           /* What the record decoder needs to know */
+    DBFOUTPUT  output;          /* Where the SQL goes */
+    FILE      *schema;          /* Collects the CREATE TABLE column list */
+    char      *createtable = NULL;
+    size_t     createtablesize;
+    char      *dbfmap;          /* For the multithreaded scanners */
+    size_t     dbfmapsize;
+    size_t     mappedrecords;
     char *inputbuffer;
-    char *outputbuffer;
     char *bufoffset;
     char *s;
     char *t;
-    int  lastcharwasreplaced = 0;
-
-    /* Datetime calculation stuff */
-    int32_t juliandays;
-    int32_t seconds;
-    int     hours;
-    int     minutes;
+    size_t recordoffset;
+
+    /* Profiling */
+    int          profileonly = 0;  /* Report column statistics and exit */
+    int          optimizeschema = 0; /* Pick column types from a profile */
+    COLUMNSTATS *stats = NULL;
+    uint64_t     scanned;
+
+    /* Sharding */
+    int          shardcount = 0;
+    char        *shardkey = NULL;
+    size_t       keyfield = 0;
+    SHARDJOB    *shardjobs;
+    uint32_t    *shardrecords;
+    size_t       shardstarts[MAXSHARDS + 1];
+    FILE        *manifest;
+    char        *manifestname;
+
+    /* Clustering */
+    char        *clusterkey = NULL;
+    size_t       clusterfield = 0;
+    size_t       sortmemory = SORTMEMORYDEFAULT; /* In megabytes */
+
+    /* Memory limit */
+    size_t       memorylimit = 0;   /* In megabytes */
+    size_t       memowindow = 0;
+    ARENA       *arena = NULL;
+
+    /* Record ranges */
+    unsigned long firstrecord = 0;       /* The first record to convert */
+    unsigned long lastrecord = ULONG_MAX; /* ...and the one after the last */
+    unsigned long recordcount;
+    int           recordrange = 0;
+    long          slice = 0;
+    long          slicecount = 0;
+    size_t        recordswanted;
+
+    /* Checkpointing */
+    unsigned long checkpointevery = 0; /* Commit every this many records */
+    unsigned long resumerecord = 0;    /* The first record to convert */
+    char         *resumesignature = NULL;
+    char          signature[17];       /* Identifies this DBF and memo file */
+    unsigned int  recordnum;
+    uint64_t      fingerprint;
 
     int     i;
     int     isreservedname;
     int     printed;
     size_t  blocksread;
-    size_t  longestfield = 32;  /* Make sure we leave at least enough room
-				 * to print out long formatted numbers, like
-				 * currencies. */
 
     /* Command line option parsing */
     int     opt;
@@ -93,17 +151,126 @@ int main(int argc, char **argv)
 				 * valid and the program should run.
 				 * Anything else is an exit code and the
 				 * program will stop. */
+    static const struct option longopts[] = {
+	{"help",      no_argument,       NULL, 'h'},
+	{"memo",      required_argument, NULL, 'm'},
+	{"optimize",  no_argument,       NULL, 'o'},
+	{"profile",   no_argument,       NULL, 'p'},
+	{"shards",    required_argument, NULL, 's'},
+	{"shard-key", required_argument, NULL, 'k'},
+	{"cluster-by",  required_argument, NULL, 'c'},
+	{"sort-memory", required_argument, NULL, 'b'},
+	{"checkpoint",  required_argument, NULL, 'C'},
+	{"resume",      required_argument, NULL, 'r'},
+	{"memo-table",  required_argument, NULL, 'M'},
+	{"table",       required_argument, NULL, 't'},
+	{"memory-limit", required_argument, NULL, 'L'},
+	{"records",     required_argument, NULL, 'R'},
+	{"slice",       required_argument, NULL, 'S'},
+	{NULL,        0,                 NULL, 0}
+    };
 
     /* Describing the PostgreSQL table */
     char *tablename;
+    char *tablenameoption = NULL;
     char  fieldname[11];
 
     /* Attempt to parse any command line arguments */
-    while((opt = getopt(argc, argv, "hm:")) != -1) {
+    while((opt = getopt_long(argc, argv, "b:C:c:hk:L:M:m:opR:r:S:s:t:", longopts, NULL)) != -1) {
 	switch(opt) {
 	case 'm':
  	    memofilename = optarg;
 	    break;
+	case 'M':
+	    if(!strcmp(optarg, "block")) {
+		memotable = MEMOTABLEBLOCK;
+	    } else if(!strcmp(optarg, "hash")) {
+		memotable = MEMOTABLEHASH;
+	    } else {
+		fprintf(stderr, "The memo table can be keyed by block or by hash\n");
+		optexitcode = EXIT_FAILURE;
+	    }
+	    break;
+	case 'o':
+	    optimizeschema = 1;
+	    break;
+	case 'p':
+	    profileonly = 1;
+	    break;
+	case 's':
+	    shardcount = atoi(optarg);
+	    if(shardcount < 1 || shardcount > MAXSHARDS) {
+		fprintf(stderr, "The number of shards must be between 1 and %d\n", MAXSHARDS);
+		optexitcode = EXIT_FAILURE;
+	    }
+	    break;
+	case 'k':
+	    shardkey = optarg;
+	    break;
+	case 't':
+	    tablenameoption = optarg;
+	    break;
+	case 'c':
+	    clusterkey = optarg;
+	    break;
+	case 'C':
+	    checkpointevery = strtoul(optarg, NULL, 10);
+	    if(!checkpointevery) {
+		fprintf(stderr, "The checkpoint interval must be at least 1 record\n");
+		optexitcode = EXIT_FAILURE;
+	    }
+	    break;
+	case 'r':
+	    /* The token is the record number and signature that were
+	     * saved in the checkpoint table */
+	    resumerecord = strtoul(optarg, &resumesignature, 10);
+	    if(*resumesignature == ':') {
+		resumesignature++;
+	    } else {
+		fprintf(stderr, "The resume point must look like RECORD:SIGNATURE\n");
+		optexitcode = EXIT_FAILURE;
+	    }
+	    break;
+	case 'L':
+	    memorylimit = strtoul(optarg, NULL, 10);
+	    if(memorylimit < MEMOLIMITSHARE * 2 * (MEMOCHUNKSIZE) / (1024 * 1024)) {
+		fprintf(stderr, "The memory limit must be at least %d megabytes\n",
+			MEMOLIMITSHARE * 2 * (MEMOCHUNKSIZE) / (1024 * 1024));
+		optexitcode = EXIT_FAILURE;
+	    }
+	    break;
+	case 'R':
+	    /* Either end of the range can be left off */
+	    recordrange = 1;
+	    firstrecord = strtoul(optarg, &s, 10);
+	    if(*s++ != ':') {
+		fprintf(stderr, "The record range must look like START:END\n");
+		optexitcode = EXIT_FAILURE;
+	    } else if(*s) {
+		lastrecord = strtoul(s, &s, 10);
+		if(*s || lastrecord < firstrecord) {
+		    fprintf(stderr, "The record range must look like START:END, with END not before START\n");
+		    optexitcode = EXIT_FAILURE;
+		}
+	    }
+	    break;
+	case 'S':
+	    slice = strtol(optarg, &s, 10);
+	    if(*s == '/') {
+		slicecount = strtol(s + 1, &s, 10);
+	    }
+	    if(*s || slice < 1 || slice > slicecount) {
+		fprintf(stderr, "The slice must look like I/N, with I from 1 to N\n");
+		optexitcode = EXIT_FAILURE;
+	    }
+	    break;
+	case 'b':
+	    sortmemory = strtoul(optarg, NULL, 10);
+	    if(!sortmemory) {
+		fprintf(stderr, "The sort memory must be at least 1 megabyte\n");
+		optexitcode = EXIT_FAILURE;
+	    }
+	    break;
 	case 'h':
 	default:
 	    /* If we got here because someone requested '-h', exit
@@ -118,13 +285,78 @@ int main(int argc, char **argv)
     if(optexitcode != EXIT_SUCCESS && optind > (argc - 1)) {
 	optexitcode = EXIT_FAILURE;
     }
+    if(optexitcode == -1 && (shardcount != 0) != (shardkey != NULL)) {
+	fprintf(stderr, "--shards and --shard-key must be used together\n");
+	optexitcode = EXIT_FAILURE;
+    }
+    if(optexitcode == -1 && shardcount && clusterkey != NULL) {
+	fprintf(stderr, "--cluster-by can't be combined with --shards\n");
+	optexitcode = EXIT_FAILURE;
+    }
+    if(optexitcode == -1 && !strcmp(argv[optind], "-")) {
+	if(tablenameoption == NULL) {
+	    fprintf(stderr, "Reading from standard input needs a --table name\n");
+	    optexitcode = EXIT_FAILURE;
+	}
+	if(profileonly || optimizeschema || shardcount) {
+	    fprintf(stderr, "--profile, --optimize and --shards need a DBF file they can map\n");
+	    optexitcode = EXIT_FAILURE;
+	}
+    }
+    if(optexitcode == -1 && memorylimit && (profileonly || optimizeschema || shardcount)) {
+	fprintf(stderr, "--profile, --optimize and --shards map whole files, so they can't keep to a --memory-limit\n");
+	optexitcode = EXIT_FAILURE;
+    }
+    if(optexitcode == -1 && recordrange && slicecount) {
+	fprintf(stderr, "--records and --slice can't be used together\n");
+	optexitcode = EXIT_FAILURE;
+    }
+    if(optexitcode == -1 && (recordrange || slicecount) &&
+       (shardcount || clusterkey != NULL || checkpointevery || resumesignature != NULL)) {
+	fprintf(stderr, "--records and --slice can't be combined with --shards, --cluster-by, --checkpoint or --resume\n");
+	optexitcode = EXIT_FAILURE;
+    }
+    if(resumesignature != NULL && !checkpointevery) {
+	checkpointevery = CHECKPOINTDEFAULT;
+    }
+    if(optexitcode == -1 && checkpointevery && (shardcount || clusterkey != NULL)) {
+	fprintf(stderr, "--checkpoint and --resume can't be combined with --shards or --cluster-by\n");
+	optexitcode = EXIT_FAILURE;
+    }
     
     if(optexitcode != -1) {
-	printf("Usage: %s [-m memofilename] filename [indexcolumn ...]\n", argv[0]);
+	printf("Usage: %s [-op] [-m memofilename [-M block|hash]] [-s shards -k shardkey]\n"
+	       "       [-c clustercolumn [-b sortmemory]] [-C records] [-r resumepoint]\n"
+	       "       [-L megabytes] [-R start:end | -S slice/slices] [-t tablename]\n"
+	       "       filename [indexcolumn ...]\n", argv[0]);
 	printf("Convert the named XBase file into SQLite format\n");
 	printf("\n");
-	printf("  -h  print this message and exit\n");
-	printf("  -m  the name of the associated memo file (if necessary)\n");
+	printf("  -h, --help      print this message and exit\n");
+	printf("  -m, --memo      the name of the associated memo file (if necessary)\n");
+	printf("  -M, --memo-table  store memos once each in a separate <table>_memo table,\n");
+	printf("                    keyed by memo block number or by a hash of the text\n");
+	printf("  -o, --optimize  profile the table first and choose tighter column types\n");
+	printf("  -p, --profile   print column statistics instead of converting the table\n");
+	printf("  -t, --table     the table name, used as given instead of the filename\n");
+	printf("                  (needed when the filename is - for standard input)\n");
+	printf("  -s, --shards    split the rows between this many SQL files, one thread each\n");
+	printf("  -k, --shard-key the column whose hash picks the shard of each row\n");
+	printf("  -c, --cluster-by  insert the rows sorted by this column\n");
+	printf("  -b, --sort-memory megabytes of memory to sort with before spilling to $TMPDIR\n");
+	printf("                    (default %d, and never more than --memory-limit leaves)\n",
+	       SORTMEMORYDEFAULT);
+	printf("  -C, --checkpoint  commit and record the progress every this many records\n");
+	printf("                    (default %d when resuming)\n", CHECKPOINTDEFAULT);
+	printf("  -r, --resume      continue a checkpointed import from RECORD:SIGNATURE as\n");
+	printf("                    saved in the " CHECKPOINTTABLE " table\n");
+	printf("  -L, --memory-limit  take every buffer from this many megabytes, and read\n");
+	printf("                    the memo file a piece at a time (at least %d)\n",
+	       MEMOLIMITSHARE * 2 * (MEMOCHUNKSIZE) / (1024 * 1024));
+	printf("  -R, --records     convert only the records from START up to but not\n");
+	printf("                    including END, counting from 0.  Only the range that\n");
+	printf("                    starts at 0 replaces the table, and only the one that\n");
+	printf("                    ends at the last record creates the indexes.\n");
+	printf("  -S, --slice       convert only the Ith of N equal ranges of records\n");
 	printf("\n");
 	printf("SQLite3-DBF is copyright 2010 Alexey Pechnikov\n");
 	printf("Utility based on source code of PgDBF (c) 2009 Daycos\n");
@@ -135,36 +367,68 @@ int main(int argc, char **argv)
 	exit(optexitcode);
     }
 
-    /* Calculate the table's name based on the DBF filename */
+    /* Calculate the table's name based on the DBF filename, unless it was
+     * given */
     dbffilename = argv[optind];
-    tablename = malloc(strlen(dbffilename) + 1);
+    tablename = malloc(strlen(tablenameoption != NULL ? tablenameoption : dbffilename) + 1);
     if(tablename == NULL) {
 	exitwitherror("Unable to allocate the tablename buffer", 1);
     }
     /* Find the first character after the final slash, or the first
      * character of the filename if no slash is present, and copy from that
      * point to the period in the extension into the tablename string. */
-    for(s = dbffilename + strlen(dbffilename) - 1; s != dbffilename; s--) {
-	if(*s == '/') {
-	    s++;
-	    break;
+    if(tablenameoption != NULL) {
+	strcpy(tablename, tablenameoption);
+    } else {
+	for(s = dbffilename + strlen(dbffilename) - 1; s != dbffilename; s--) {
+	    if(*s == '/') {
+		s++;
+		break;
+	    }
 	}
+	t = tablename;
+	while(*s) {
+	    if(*s == '.') {
+		break;
+	    }
+	    *t++ = tolower(*s++);
+	}
+	*t = '\0';
     }
-    t = tablename;
-    while(*s) {
-	if(*s == '.') {
-	    break;
+
+    /* Set aside all the memory the conversion may use.  The memo file's
+     * window comes off the top, and everything else is handed out from the
+     * rest. */
+    if(memorylimit) {
+	arena = malloc(sizeof(ARENA));
+	if(arena == NULL) {
+	    exitwitherror("Unable to malloc the memory arena", 1);
+	}
+	memowindow = memorylimit * 1024 * 1024 / MEMOLIMITSHARE;
+	arena->size = memorylimit * 1024 * 1024 - memowindow;
+	arena->used = 0;
+	arena->base = malloc(arena->size);
+	if(arena->base == NULL) {
+	    exitwitherror("Unable to malloc the memory arena", 1);
 	}
-	*t++ = tolower(*s++);
     }
-    *t = '\0';
 
-    /* Get the DBF header */
-    dbffile = fopen(dbffilename, "rb");
+    /* Get the DBF header.  Compressed files are unpacked on the fly, and
+     * everything after this point only reads forward, so that the DBF file
+     * can also come from a pipe. */
+    dbfdecompressor = decompressorfor(dbffilename);
+    if(!strcmp(dbffilename, "-")) {
+	dbffile = stdin;
+    } else if(dbfdecompressor != NULL) {
+	dbffile = fdopen(startdecompressor(dbffilename, dbfdecompressor, &dbfdecompressorpid), "rb");
+    } else {
+	dbffile = fopen(dbffilename, "rb");
+    }
     if(dbffile == NULL) {
 	exitwitherror("Unable to open the DBF file", 1);
     }
-    if(setvbuf(dbffile, NULL, _IOFBF, DBFBATCHTARGET)) {
+    if(setvbuf(dbffile, arena != NULL ? arenaalloc(arena, DBFBATCHTARGET, "the DBF file buffer") : NULL,
+	       _IOFBF, DBFBATCHTARGET)) {
 	exitwitherror("Unable to set the buffer for the dbf file", 1);
     }
     if(fread(&dbfheader, sizeof(dbfheader), 1, dbffile) != 1) {
@@ -209,8 +473,24 @@ int main(int argc, char **argv)
     if(pgfields == NULL) {
 	exitwitherror("Unable to malloc the output parameter list", 1);
     }
+    recordoffset = 1;           /* Skip the deletion flag */
     for(i = 0; i < fieldcount; i++) {
 	pgfields[i].formatstring = NULL;
+	pgfields[i].integer = 0;
+	pgfields[i].offset = recordoffset;
+	recordoffset += fields[i].length;
+	/* Decide whether to use numeric or packed int memo block number */
+	if(fields[i].type == 'M' || fields[i].type == 'G') {
+	    if(fields[i].length == 4) {
+		pgfields[i].memonumbering = PACKEDMEMOSTYLE;
+	    } else if(fields[i].length == 10) {
+		pgfields[i].memonumbering = NUMERICMEMOSTYLE;
+	    } else if(fields[i].type == 'M') {
+		exitwitherror("Unknown memo record number style", 0);
+	    } else {
+		pgfields[i].memonumbering = UNKNOWNMEMOSTYLE;
+	    }
+	}
     }
 
     /* Check for the terminator character */
@@ -222,52 +502,235 @@ int main(int argc, char **argv)
     }
 
     /* Skip the database container if necessary */
-    if(fseek(dbffile, skipbytes, SEEK_CUR)) {
-	exitwitherror("Unable to seek in the DBF file", 1);
-    }
+    skipinput(dbffile, skipbytes);
 
-    /* Make sure we're at the right spot before continuing */
-    if(ftell(dbffile) != littleint16_t(dbfheader.headerlength)) {
+    /* Make sure we're at the right spot before continuing, unless we're
+     * reading from a decompressor that can't tell */
+    dbfoffset = ftell(dbffile);
+    if(dbfoffset != -1 && dbfoffset != littleint16_t(dbfheader.headerlength)) {
 	exitwitherror("At an unexpected offset in the DBF file", 0);
     }
 
     /* Open the given memofile */
     if(memofilename != NULL) {
-	memofd = open(memofilename, O_RDONLY);
-	if(memofd == -1) {
-	    exitwitherror("Unable to open the memofile", 1);
+	memodecompressor = decompressorfor(memofilename);
+	if(memodecompressor != NULL && memorylimit) {
+	    /* There may not be room to unpack the whole file in memory,
+	     * so unpack it to disk and map a window's worth at a time */
+	    memofd = unpackdecompressed(memofilename, memodecompressor, arena, &memosize);
+	    memochunks = openmemochunks(memofd, memosize, memowindow, arena);
+	} else if(memodecompressor != NULL) {
+	    /* Memos need random access, so unpack the whole file into
+	     * anonymous memory */
+	    memomap = mapdecompressed(memofilename, memodecompressor, &memosize);
+	} else {
+	    memofd = open(memofilename, O_RDONLY | O_CLOEXEC);
+	    if(memofd == -1) {
+		exitwitherror("Unable to open the memofile", 1);
+	    }
+	    if (fstat(memofd, &memostat) == -1) {
+		exitwitherror("Unable to fstat the memofile", 1);
+	    }
+	    if(S_ISREG(memostat.st_mode) && memorylimit) {
+		/* Only map a window's worth of it at a time */
+		memosize = memostat.st_size;
+		memochunks = openmemochunks(memofd, memosize, memowindow, arena);
+	    } else if(S_ISREG(memostat.st_mode)) {
+		memosize = memostat.st_size;
+		memomap = mmap(NULL, memostat.st_size, PROT_READ, MAP_PRIVATE, memofd, 0);
+		if(memomap == MAP_FAILED) {
+		    exitwitherror("Unable to mmap the memofile", 1);
+		}
+	    } else if(profileonly || optimizeschema || shardcount) {
+		/* The scanning threads need the whole pipe at hand */
+		memomap = mapstream(memofd, &memosize);
+	    } else {
+		/* Read the pipe forward through a window instead */
+		memostream = openmemostream(memofd, memorylimit ? memowindow : MEMOWINDOW, arena);
+	    }
 	}
-	if (fstat(memofd, &memostat) == -1) {
-	    exitwitherror("Unable to fstat the memofile", 1);
+	if(memostream != NULL) {
+	    memoheader = memostreamfetch(memostream, 0, sizeof(MEMOHEADER), &memoheadersize);
+	} else if(memochunks != NULL) {
+	    memoheader = memochunkfetch(memochunks, 0, &memoheadersize);
+	} else {
+	    memoheader = memomap;
+	    memoheadersize = memosize;
 	}
-	memomap = mmap(NULL, memostat.st_size, PROT_READ, MAP_PRIVATE, memofd, 0);
-	if(memomap == MAP_FAILED) {
-	    exitwitherror("Unable to mmap the memofile", 1);
+	if(memoheadersize < 8) {
+	    exitwitherror("The memo file is too short to have a header", 0);
 	}
 	if(dbfheader.signature == (int8_t) 0x83) {
 	    memoblocksize = 512;
 	} else {
-	    memoblocksize = (size_t) sbigint16_t(((MEMOHEADER*) memomap)->blocksize);
+	    memoblocksize = (size_t) sbigint16_t(((MEMOHEADER*) memoheader)->blocksize);
+	}
+    }
+
+    /* Fingerprint the table layout, the memo file and the options that
+     * shape the rows so that a resumed import can tell whether any of them
+     * changed since the checkpoint */
+    fingerprint = hashbuf((char *) &dbfheader, sizeof(dbfheader));
+    fingerprint = fingerprint * 31 + hashbuf((char *) fields, fieldarraysize);
+    fingerprint = fingerprint * 31 + (memofilename != NULL ? memotable : MEMOTABLENONE);
+    fingerprint = fingerprint * 31 + optimizeschema;
+    if(memofilename != NULL) {
+	fingerprint = fingerprint * 31 + memosize;
+	fingerprint = fingerprint * 31 + hashbuf(memoheader, 8);
+    }
+    snprintf(signature, sizeof(signature), "%016jx", (uintmax_t) fingerprint);
+    if(resumesignature != NULL) {
+	if(strcmp(resumesignature, signature)) {
+	    exitwitherror("The DBF file, the memo file or the -M and -o options have changed since the checkpoint was saved", 0);
+	}
+	if(resumerecord > littleint32_t(dbfheader.recordcount)) {
+	    exitwitherror("The resume point is past the end of the DBF file", 0);
 	}
+	firstrecord = resumerecord;
     }
 
-    /* Encapsulate the whole process in a transaction */
-    printf("BEGIN;\n");
-    printf("DROP TABLE IF EXISTS");
-    printf(" %s;\n", tablename);
+    /* Work out which records to convert.  Slices split the table as
+     * evenly as whole records allow. */
+    recordcount = littleint32_t(dbfheader.recordcount);
+    if(slicecount) {
+	firstrecord = (uint64_t) recordcount * (slice - 1) / slicecount;
+	lastrecord = (uint64_t) recordcount * slice / slicecount;
+    }
+    if(lastrecord > recordcount) {
+	lastrecord = recordcount;
+    }
+    if(firstrecord > lastrecord) {
+	exitwitherror("The record range starts past the end of the DBF file", 0);
+    }
+
+    /* Describe the table for the record decoder */
+    table.tablename = tablename;
+    table.fields = fields;
+    table.pgfields = pgfields;
+    table.fieldcount = fieldcount;
+    table.recordlength = littleint16_t(dbfheader.recordlength);
+    table.memomap = memomap;
+    table.memosize = memosize;
+    table.memoblocksize = memoblocksize;
+    table.dbase3memos = dbfheader.signature == (int8_t) 0x83;
+    table.memotable = memofilename != NULL ? memotable : MEMOTABLENONE;
+    table.memostream = memostream;
+    table.memochunks = memochunks;
+    table.memopiece = memorylimit ? MEMOCHUNKSIZE : SIZE_MAX;
+
+    /* Find the column to partition on */
+    if(shardkey != NULL) {
+	keyfield = findfield(fields, fieldcount, shardkey);
+	if(keyfield == fieldcount) {
+	    fprintf(stderr, "Table %s has no column named %s\n", tablename, shardkey);
+	    exit(EXIT_FAILURE);
+	}
+	if(fields[keyfield].type == 'M' || fields[keyfield].type == 'G') {
+	    exitwitherror("Can't shard by a memo column", 0);
+	}
+    }
+
+    /* Find the column to sort on */
+    if(clusterkey != NULL) {
+	clusterfield = findfield(fields, fieldcount, clusterkey);
+	if(clusterfield == fieldcount) {
+	    fprintf(stderr, "Table %s has no column named %s\n", tablename, clusterkey);
+	    exit(EXIT_FAILURE);
+	}
+	if(fields[clusterfield].type == 'M' || fields[clusterfield].type == 'G') {
+	    exitwitherror("Can't cluster by a memo column", 0);
+	}
+	/* Build the clustering column's index first, while the table's
+	 * pages are still in key order */
+	for(i = optind + 1; i < argc; i++) {
+	    if(!strcasecmp(argv[i], clusterkey)) {
+		s = argv[i];
+		memmove(argv + optind + 2, argv + optind + 1, (i - optind - 1) * sizeof(char *));
+		argv[optind + 1] = s;
+		break;
+	    }
+	}
+    }
+
+    /* Scan the whole table up front if the statistics are wanted */
+    if(profileonly || optimizeschema) {
+	for(fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
+	    if((fields[fieldnum].type == 'M' || fields[fieldnum].type == 'G') && memofilename == NULL) {
+		fprintf(stderr, "Table %s has memo fields, but couldn't open the related memo file\n", tablename);
+		exit(EXIT_FAILURE);
+	    }
+	}
+	dbfmap = mapdbf(dbffilename, &dbfheader, &dbfmapsize, &mappedrecords);
+	stats = profiletable(&table, dbfmap + littleint16_t(dbfheader.headerlength),
+			     mappedrecords, &scanned);
+	if(munmap(dbfmap, dbfmapsize) == -1) {
+	    exitwitherror("Unable to munmap the DBF file", 1);
+	}
+    }
+    if(profileonly) {
+	printf("-- Table %s: %ju of %ju records are not deleted\n", tablename,
+	       (uintmax_t) scanned, (uintmax_t) littleint32_t(dbfheader.recordcount));
+	printf("-- %-10s %4s %6s %9s %7s %10s  %s\n", "column", "type", "length",
+	       "maxlength", "blank", "distinct", "notes");
+	for(fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
+	    if(fields[fieldnum].type == '0') {
+		continue;
+	    }
+	    s = fields[fieldnum].name;
+	    t = fieldname;
+	    while(*s) {
+		*t++ = tolower(*s++);
+	    }
+	    *t = '\0';
+	    printf("-- %-10s %4c %6d %9zu %6.1f%% %10.0f ", fieldname,
+		   fields[fieldnum].type, fields[fieldnum].length,
+		   stats[fieldnum].maxlength,
+		   scanned ? 100.0 * stats[fieldnum].blanks / scanned : 0.0,
+		   hllestimate(stats[fieldnum].registers));
+	    switch(fields[fieldnum].type) {
+	    case 'C':
+		printf(" fits TEXT(%zu)", stats[fieldnum].maxlength ? stats[fieldnum].maxlength : 1);
+		break;
+	    case 'N':
+		if(stats[fieldnum].nonintegral) {
+		    printf(" has fractions, stays TEXT");
+		} else if(stats[fieldnum].overflow) {
+		    printf(" integral but too wide for INTEGER");
+		} else {
+		    printf(" fits INTEGER");
+		}
+		break;
+	    case 'G':
+	    case 'M':
+		printf(" %ju bad memo pointers (memo file is %zu bytes)",
+		       (uintmax_t) stats[fieldnum].badmemos, memosize);
+		break;
+	    }
+	    printf("\n");
+	}
+	/* Nothing else to do, since no SQL is wanted */
+	free(stats);
+	exit(EXIT_SUCCESS);
+    }
 
     /* Generate the create table statement, do some sanity testing, and scan
      * for a few additional output parameters.  This is an ugly loop that
      * does lots of stuff, but extracting it into two or more loops with the
-     * same structure and the same switch-case block seemed even worse. */
-    printf("CREATE TABLE %s (", tablename);
+     * same structure and the same switch-case block seemed even worse.
+     * The column list is collected in memory so that it can be written to
+     * every output. */
+    schema = open_memstream(&createtable, &createtablesize);
+    if(schema == NULL) {
+	exitwitherror("Unable to open a buffer for the CREATE TABLE statement", 1);
+    }
+    fprintf(schema, "(");
     printed = 0;
     for(fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
 	if(fields[fieldnum].type == '0') {
 	    continue;
 	}
 	if(printed) {
-	    printf(", ");
+	    fprintf(schema, ", ");
 	} else {
 	    printed = 1;
 	}
@@ -279,7 +742,7 @@ int main(int argc, char **argv)
 	}
 	*t = '\0';
 
-        printf("\"%s\" ", fieldname);
+	fprintf(schema, "\"%s\" ", fieldname);
 	switch(fields[fieldnum].type) {
 	case 'B':
 	    /* Precalculate this field's format string so that it doesn't
@@ -287,249 +750,196 @@ int main(int argc, char **argv)
 	    if(asprintf(&pgfields[fieldnum].formatstring, "%%.%dlf", fields[fieldnum].decimals) < 0) {
 		exitwitherror("Unable to allocate a format string", 1);
 	    }
-	    printf("FLOAT");
+	    fprintf(schema, "FLOAT");
 	    break;
 	case 'C':
-	    printf("TEXT(%d)", fields[fieldnum].length);
+	    if(optimizeschema) {
+		/* Size the column for the longest value actually seen */
+		fprintf(schema, "TEXT(%zu)", stats[fieldnum].maxlength ? stats[fieldnum].maxlength : 1);
+	    } else {
+		fprintf(schema, "TEXT(%d)", fields[fieldnum].length);
+	    }
 	    break;
 	case 'D':
-	    printf("DATE");
+	    fprintf(schema, "DATE");
 	    break;
 	case 'F':
-	    printf("NUMERIC(%d)", fields[fieldnum].decimals);
+	    fprintf(schema, "NUMERIC(%d)", fields[fieldnum].decimals);
 	    break;
 	case 'G':
-	    printf("BLOB");
+	    fprintf(schema, "BLOB");
 	    break;
 	case 'I':
-	    printf("INTEGER");
+	    fprintf(schema, "INTEGER");
 	    break;
 	case 'L':
 	    /* This was a smallint at some point in the past */
-	    printf("BOOLEAN");	    break;
+	    fprintf(schema, "BOOLEAN");      break;
 	case 'M':
 	    if(memofilename == NULL) {
-		printf("\n");
 		fprintf(stderr, "Table %s has memo fields, but couldn't open the related memo file\n", tablename);
 		exit(EXIT_FAILURE);
 	    }
-	    printf("TEXT");
-	    /* Decide whether to use numeric or packed int memo block
-	     * number */
-	    if(fields[fieldnum].length == 4) {
-		pgfields[fieldnum].memonumbering = PACKEDMEMOSTYLE;
-	    } else if (fields[fieldnum].length == 10) {
-		pgfields[fieldnum].memonumbering = NUMERICMEMOSTYLE;
+	    if(table.memotable != MEMOTABLENONE) {
+		fprintf(schema, "INTEGER REFERENCES %s_memo(id)", tablename);
 	    } else {
-		exitwitherror("Unknown memo record number style", 0);
+		fprintf(schema, "TEXT");
 	    }
 	    break;
 	case 'N':
 	    /* Was a numeric at one point, but for our purposes a text field
 	     * is better because there isn't a perfect overlap between
-	     * FoxPro and PostgreSQL numeric types */
-	    printf("TEXT");
+	     * FoxPro and PostgreSQL numeric types.  The profiler can prove
+	     * that a column only holds 64-bit integers, though. */
+	    if(optimizeschema && !stats[fieldnum].nonintegral && !stats[fieldnum].overflow) {
+		pgfields[fieldnum].integer = 1;
+		fprintf(schema, "INTEGER");
+	    } else {
+		fprintf(schema, "TEXT");
+	    }
 	    break;
 	case 'T':
-	    printf("TIMESTAMP");
+	    fprintf(schema, "TIMESTAMP");
 	    break;
 	case 'Y':
-	    printf("DECIMAL(4)");
+	    fprintf(schema, "DECIMAL(4)");
 	    break;
 	default:
-	    printf("\n");
 	    fprintf(stderr, "Unhandled field type: %c\n", fields[fieldnum].type);
 	    exit(EXIT_FAILURE);
 	}
-	if(fields[fieldnum].length > longestfield) {
-	    longestfield = fields[fieldnum].length;
-	}
     }
-    printf(");\n");
-
-    dbfbatchsize = DBFBATCHTARGET / littleint16_t(dbfheader.recordlength);
-    if(!dbfbatchsize) {
-	dbfbatchsize = 1;
-    }
-    inputbuffer = malloc(littleint16_t(dbfheader.recordlength) * dbfbatchsize);
-    if(inputbuffer == NULL) {
-	exitwitherror("Unable to malloc a record buffer", 1);
-    }
-    outputbuffer = malloc(longestfield + 1);
-    if(outputbuffer == NULL) {
-	exitwitherror("Unable to malloc the output buffer", 1);
+    fprintf(schema, ")");
+    if(fclose(schema)) {
+	exitwitherror("Unable to build the CREATE TABLE statement", 1);
     }
 
-    /* Loop across records in the file, taking 'dbfbatchsize' at a time, and
-     * output them in PostgreSQL-compatible format */
-    for(recordbase = 0; recordbase < littleint32_t(dbfheader.recordcount); recordbase += dbfbatchsize) {
-	blocksread = fread(inputbuffer, littleint16_t(dbfheader.recordlength), dbfbatchsize, dbffile);
-	if(blocksread != dbfbatchsize &&
-	   recordbase + blocksread < littleint32_t(dbfheader.recordcount)) {
-	    exitwitherror("Unable to read an entire record", 1);
+    if(shardcount) {
+	/* Sort the records into shards first, then hand each shard to
+	 * its own thread to decode */
+	dbfmap = mapdbf(dbffilename, &dbfheader, &dbfmapsize, &mappedrecords);
+	shardrecords = partitionrecords(&table, dbfmap + littleint16_t(dbfheader.headerlength),
+					mappedrecords, keyfield, shardcount, shardstarts);
+	shardjobs = calloc(shardcount, sizeof(SHARDJOB));
+	if(shardjobs == NULL) {
+	    exitwitherror("Unable to malloc the shard descriptions", 1);
 	}
-	for(batchindex = 0; batchindex < blocksread; batchindex++) {
-	    bufoffset = inputbuffer + littleint16_t(dbfheader.recordlength) * batchindex;
-	    /* Skip deleted records */
-	    if(bufoffset[0] == '*') {
-		continue;
+	for(i = 0; i < shardcount; i++) {
+	    shardjobs[i].table = &table;
+	    shardjobs[i].records = dbfmap + littleint16_t(dbfheader.headerlength);
+	    shardjobs[i].recordnums = shardrecords + shardstarts[i];
+	    shardjobs[i].recordcount = shardstarts[i + 1] - shardstarts[i];
+	    shardjobs[i].createtable = createtable;
+	    shardjobs[i].indexes = argv + optind + 1;
+	    shardjobs[i].indexcount = argc - optind - 1;
+	    if(asprintf(&shardjobs[i].filename, "%s.%d.sql", tablename, i) < 0) {
+		exitwitherror("Unable to allocate a shard filename", 1);
 	    }
-	    printf("INSERT INTO %s VALUES(", tablename);
-	    bufoffset++;
-	    for(fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
-		if(fields[fieldnum].type == '0') {
-		    continue;
-		}
-		if(fieldnum) {
-		    printf(",");
+	    if(pthread_create(&shardjobs[i].thread, NULL, shardworker, &shardjobs[i])) {
+		exitwitherror("Unable to start a shard thread", 0);
+	    }
+	}
+	for(i = 0; i < shardcount; i++) {
+	    if(pthread_join(shardjobs[i].thread, NULL)) {
+		exitwitherror("Unable to join a shard thread", 0);
+	    }
+	}
+
+	/* Describe the partitioning for whoever ATTACHes the shards */
+	if(asprintf(&manifestname, "%s.manifest", tablename) < 0) {
+	    exitwitherror("Unable to allocate the manifest filename", 1);
+	}
+	manifest = fopen(manifestname, "w");
+	if(manifest == NULL) {
+	    exitwitherror("Unable to open the manifest file", 1);
+	}
+	fprintf(manifest, "table\t%s\n", tablename);
+	fprintf(manifest, "source\t%s\n", dbffilename);
+	fprintf(manifest, "shardkey\t%s\n", shardkey);
+	fprintf(manifest, "shards\t%d\n", shardcount);
+	fprintf(manifest, "hash\tfnv1a64-fmix64(the key's value as written in the SQL, without quotes) %% shards\n");
+	for(i = 0; i < shardcount; i++) {
+	    fprintf(manifest, "shard\t%d\t%s\t%ju\n", i, shardjobs[i].filename,
+		    (uintmax_t) shardjobs[i].output.rows);
+	    free(shardjobs[i].filename);
+	}
+	if(fclose(manifest)) {
+	    exitwitherror("Unable to write the manifest file", 1);
+	}
+	free(manifestname);
+	free(shardjobs);
+	free(shardrecords);
+	if(munmap(dbfmap, dbfmapsize) == -1) {
+	    exitwitherror("Unable to munmap the DBF file", 1);
+	}
+    } else {
+	openoutput(&output, stdout, &table, arena);
+
+	/* Encapsulate the whole process in a transaction.  A resumed
+	 * import, or any range but the first, carries on with the table
+	 * that's already there, or creates it in a database of its own. */
+	if(resumesignature != NULL || firstrecord) {
+	    printpreamble(stdout, &table, createtable, 0);
+	} else {
+	    printpreamble(stdout, &table, createtable, 1);
+	    if(checkpointevery) {
+		printf("CREATE TABLE IF NOT EXISTS " CHECKPOINTTABLE
+		       " (tablename TEXT PRIMARY KEY, record INTEGER, signature TEXT);\n");
+		printcheckpoint(stdout, tablename, 0, signature);
+	    }
+	}
+
+	if(clusterkey != NULL) {
+	    clusterrecords(dbffile, littleint32_t(dbfheader.recordcount), &table,
+			   clusterfield, sortmemory * 1024 * 1024, &output);
+	} else {
+	    dbfbatchsize = DBFBATCHTARGET / littleint16_t(dbfheader.recordlength);
+	    if(!dbfbatchsize) {
+		dbfbatchsize = 1;
+	    }
+	    inputbuffer = arenaalloc(arena, littleint16_t(dbfheader.recordlength) * dbfbatchsize,
+				     "a record buffer");
+
+	    skipinput(dbffile, (size_t) firstrecord * littleint16_t(dbfheader.recordlength));
+
+	    /* Loop across records in the file, taking 'dbfbatchsize' at a time,
+	     * and output them in SQLite-compatible format */
+	    for(recordbase = firstrecord; recordbase < lastrecord; recordbase += dbfbatchsize) {
+		recordswanted = lastrecord - recordbase < dbfbatchsize ? lastrecord - recordbase : dbfbatchsize;
+		blocksread = fread(inputbuffer, littleint16_t(dbfheader.recordlength), recordswanted, dbffile);
+		if(blocksread != recordswanted) {
+		    exitwitherror("Unable to read an entire record", ferror(dbffile));
 		}
-		switch(fields[fieldnum].type) {
-		case 'B':
-		    /* Double floats */
-		    printf(pgfields[fieldnum].formatstring, sdouble(bufoffset));
-		    break;
-		case 'C':
-		    /* Varchars */
-		    safeprintbuf(bufoffset, fields[fieldnum].length);
-		    break;
-		case 'D':
-		    /* Datestamps */
-		    if(bufoffset[0] == ' ' || bufoffset[0] == '\0') {
-			printf("'\\N'");
-		    } else {
-			s = outputbuffer;
-			*s++ = bufoffset[0];
-			*s++ = bufoffset[1];
-			*s++ = bufoffset[2];
-			*s++ = bufoffset[3];
-			*s++ = '-';
-			*s++ = bufoffset[4];
-			*s++ = bufoffset[5];
-			*s++ = '-';
-			*s++ = bufoffset[6];
-			*s++ = bufoffset[7];
-			*s++ = '\0';
-			printf("'%s'", outputbuffer);
-		    }
-		    break;
-		case 'G':
-		    /* General binary objects */
-		    /* This is left unimplemented to avoid breakage for
-		       people porting databases with OLE objects, at least
-		       until someone comes up with a good way to display
-		       them. */
-		    break;
-		case 'I':
-		    /* Integers */
-		    printf("'%d'", slittleint32_t(bufoffset));
-		    break;
-		case 'L':
-		    /* Booleans */
-		    switch(bufoffset[0]) {
-		    case 'Y':
-		    case 'T':
-			printf("1");
-			break;
-		    default:
-			printf("0");
-			break;
-		    }
-		    break;
-		case 'M':
-		    /* Memos */
-		    if(pgfields[fieldnum].memonumbering == PACKEDMEMOSTYLE) {
-			memoblocknumber = slittleint32_t(bufoffset);
-		    } else {
-			memoblocknumber = 0;
-			s = bufoffset;
-			for(i = 0; i < 10; i++) {
-			    if(*s != 32) {
-				/* I'm unaware of any non-ASCII
-				   implementation of XBase. */
-				memoblocknumber = memoblocknumber * 10 + *s - '0';
-			    }
-			    s++;
-			}
+		for(batchindex = 0; batchindex < blocksread; batchindex++) {
+		    bufoffset = inputbuffer + littleint16_t(dbfheader.recordlength) * batchindex;
+		    /* Skip deleted records */
+		    if(bufoffset[0] != '*') {
+			printrecord(&table, &output, bufoffset);
 		    }
-		    if(memoblocknumber) {
-			memorecord = memomap + memoblocksize * memoblocknumber;
-			if(dbfheader.signature == (int8_t) 0x83) {
-			    t = strchr(memorecord, 0x1A);
-			    safeprintbuf(memorecord, t - memorecord);
-			} else {
-			    safeprintbuf(memorecord + 8, sbigint32_t(memorecord + 4));
-			}
+		    /* Commit a chunk and note where the next one starts */
+		    recordnum = recordbase + batchindex + 1;
+		    if(checkpointevery && recordnum % checkpointevery == 0 &&
+		       recordnum < littleint32_t(dbfheader.recordcount)) {
+			printcheckpoint(stdout, tablename, recordnum, signature);
+			printf("COMMIT;\nBEGIN;\n");
 		    }
-		    break;
-		case 'F':
-		case 'N':
-		    /* Numerics */
-		    strncpy(outputbuffer, bufoffset, fields[fieldnum].length);
-		    outputbuffer[fields[fieldnum].length] = '\0';
-		    /* Strip off *leading* spaces */
-		    s = outputbuffer;
-		    while(*s == ' ') {
-			s++;
-		    }
-		    if(*s == '\0') {
-			printf("'\\N'");
-		    } else {
-			printf("'%s'", s);
-		    }
-		    break;
-		case 'T':
-		    /* Timestamps */
-		    juliandays = slittleint32_t(bufoffset);
-		    seconds = (slittleint32_t(bufoffset + 4) + 1) / 1000;
-		    if(!(juliandays || seconds)) {
-			printf("'\\N'");
-		    } else {
-			hours = seconds / 3600;
-			seconds -= hours * 3600;
-			minutes = seconds / 60;
-			seconds -= minutes * 60;
-			printf("'J%d %02d:%02d:%02d'", juliandays, hours, minutes, seconds);
-		    }
-		    break;
-		case 'Y':
-		    /* Currency */
-		    t = outputbuffer + sprintf(outputbuffer, "%05jd", (intmax_t)slittleint64_t(bufoffset));
-		    *(t + 1) = '\0';
-		    *(t) = *(t - 1);
-		    *(t - 1) = *(t - 2);
-		    *(t - 2) = *(t - 3);
-		    *(t - 3) = *(t - 4);
-		    *(t - 4) = '.';
-		    printf("%s", outputbuffer);
-		    break;
-		};
-		bufoffset += fields[fieldnum].length;
+		}
 	    }
-	    printf(");\n");
+	    arenafree(arena, inputbuffer);
 	}
-    }
-    free(inputbuffer);
-    free(outputbuffer);
+	closeoutput(&output);
 
-    /* Until this point, no changes have been flushed to the database */
-    printf("COMMIT;\n");
+	/* Until this point, no changes have been flushed to the database */
+	if(checkpointevery) {
+	    printcheckpoint(stdout, tablename, littleint32_t(dbfheader.recordcount), signature);
+	}
+	printf("COMMIT;\n");
 
-    /* Generate the indexes */
-    for(i = optind + 1; i < argc; i++ ){
-	printf("CREATE INDEX %s_", tablename);
-	for(s = argv[i]; *s; s++) {
-	    if(isalnum(*s)) {
-		putchar(*s);
-		lastcharwasreplaced = 0;
-	    } else {
-		/* Only output one underscore in a row */
-		if(!lastcharwasreplaced) {
-		    putchar('_');
-		    lastcharwasreplaced = 1;
-		}
-	    }
+	/* Index the table once, after the last of its rows are in */
+	if(lastrecord == recordcount) {
+	    printindexes(stdout, tablename, argv + optind + 1, argc - optind - 1,
+			 resumesignature != NULL);
 	}
-	printf(" ON %s(%s);\n", tablename, argv[i]);
     }
 
     free(tablename);
@@ -540,12 +950,31 @@ int main(int argc, char **argv)
 	}
     }
     free(pgfields);
+    free(stats);
+    free(createtable);
     fclose(dbffile);
     if(memomap != NULL) {
-	if(munmap(memomap, memostat.st_size) == -1) {
+	if(munmap(memomap, memosize) == -1) {
 	    exitwitherror("Unable to munmap the memofile", 1);
 	}
+    }
+    if(memostream != NULL) {
+	closememostream(memostream, arena);
+    }
+    if(memochunks != NULL) {
+	closememochunks(memochunks, arena);
+    }
+    if(memofd != -1) {
 	close(memofd);
     }
+    /* Only wait once every pipe is closed, in case a decompressor is still
+     * writing to one */
+    if(dbfdecompressorpid) {
+	waitdecompressor(dbfdecompressorpid);
+    }
+    if(arena != NULL) {
+	free(arena->base);
+	free(arena);
+    }
     return 0;
 }
@@ -24,9 +24,8 @@ Programmed by Alexey Pechnikov (pechnikov@mobigroup.ru) for SQLite
 #include <stdlib.h>
 #include <string.h>
 
-/* This should be big enough to hold most of the varchars and memo fields
- * that you'll be processing.  If a given piece of data won't fit in a
- * buffer of this size, then a temporary buffer will be allocated for it. */
+/* Every output stream gets an escape buffer of this size.  Values that
+ * won't fit in it are escaped and written out a buffer-full at a time. */
 #define STATICBUFFERSIZE 1024 * 1024
 
 /* Attempt to read approximately this many bytes from the .dbf file at once.
@@ -35,11 +34,72 @@ Programmed by Alexey Pechnikov (pechnikov@mobigroup.ru) for SQLite
 
 /* Old versions of FoxPro (and probably other programs) store the memo file
  * record number in human-readable ASCII. Newer versions of FoxPro store it
- * as a 32-bit packed int. */
+ * as a 32-bit packed int.  A 'G' field that's neither is left empty. */
 #define NUMERICMEMOSTYLE 0
 #define PACKEDMEMOSTYLE 1
+#define UNKNOWNMEMOSTYLE 2
 
-static char staticbuf[STATICBUFFERSIZE + 1];
+/* The block types in a FoxPro memo block header.  Only text is escaped as
+ * text, and everything else is written as a blob. */
+#define MEMOPICTURE 0
+#define MEMOTEXT 1
+#define MEMOOBJECT 2
+
+/* The profiler splits the records between at most this many threads, and
+ * won't bother starting a thread for fewer than PROFILEMINRECORDS. */
+#define PROFILEMAXTHREADS 64
+#define PROFILEMINRECORDS 4096
+
+/* Each column's distinct count is estimated with a HyperLogLog sketch of
+ * 2^HLLBITS registers, which gives a standard error of about 1.6%. */
+#define HLLBITS 12
+#define HLLREGISTERS (1 << HLLBITS)
+
+/* How the profiler classifies the contents of an 'N' field */
+#define NUMERICINTEGER 0
+#define NUMERICFRACTION 1
+#define NUMERICOVERFLOW 2
+
+/* Where memo text goes: inline in the table, or once per memo block or
+ * once per distinct text in a separate <table>_memo table */
+#define MEMOTABLENONE 0
+#define MEMOTABLEBLOCK 1
+#define MEMOTABLEHASH 2
+
+/* The most output files that --shards will write at once */
+#define MAXSHARDS 256
+
+/* --cluster-by sorts with this much memory (in megabytes) unless told
+ * otherwise, and merges at most SORTMAXRUNS spill files at once */
+#define SORTMEMORYDEFAULT 256
+#define SORTMAXRUNS 128
+
+/* Checkpointed imports commit every CHECKPOINTDEFAULT records unless told
+ * otherwise, and record their progress in this table */
+#define CHECKPOINTDEFAULT 100000
+#define CHECKPOINTTABLE "sqlite3dbf_checkpoint"
+
+/* Compressed files that have to be unpacked into memory start out with a
+ * mapping this big, which doubles as needed */
+#define DECOMPRESSINITIAL 16 * 1024 * 1024
+
+/* A memo file that can't be mapped (like a pipe) is read forward through a
+ * window of at most this many bytes, which is enough as long as records
+ * refer to memos in roughly the order they were written */
+#define MEMOWINDOW 64 * 1024 * 1024
+
+/* Under --memory-limit, this share of the limit goes to the memo file,
+ * which is mapped MEMOCHUNKSIZE bytes at a time and read in pieces no
+ * bigger than that */
+#define MEMOLIMITSHARE 4
+#define MEMOCHUNKSIZE 1024 * 1024
+
+/* ...and this share of what's left after that is set aside for remembering
+ * which memos have been written to a memo table, where a sort can't take it */
+#define MEMOSEENSHARE 4
+
+/* The FNV-1a offset basis that hashes start from */
+#define HASHSEED 0xcbf29ce484222325ULL
 
 typedef struct {
     int8_t   signature;
@@ -84,10 +144,150 @@ typedef struct
 
 typedef struct
 {
-    char *formatstring;
-    int   memonumbering;
+    char   *formatstring;
+    int     memonumbering;
+    size_t  offset;             /* Where this field starts in a record */
+    int     integer;            /* Declared INTEGER by --optimize */
 } PGFIELD;
 
+typedef struct
+{
+    size_t   maxlength;         /* The longest trimmed value */
+    uint64_t blanks;            /* Empty, blank, or null values */
+    int      nonintegral;       /* Some 'N' value has a fraction */
+    int      overflow;          /* Some 'N' value won't fit in 64 bits */
+    uint64_t badmemos;          /* Memo pointers past the end of the file */
+    uint8_t  registers[HLLREGISTERS];
+} COLUMNSTATS;
+
+typedef struct
+{
+    /* A fixed amount of memory that --memory-limit hands out piece by
+     * piece, so that nothing can quietly grow past it */
+    char   *base;
+    size_t  size;
+    size_t  used;
+} ARENA;
+
+typedef struct
+{
+    /* The part of an unmappable memo file that's currently in memory */
+    int     fd;
+    char   *buffer;
+    size_t  capacity;
+    size_t  start;              /* The file offset of buffer[0] */
+    size_t  length;             /* How much of the buffer is filled */
+    int     eof;
+    int     fixed;              /* The window may not grow */
+} MEMOSTREAM;
+
+typedef struct
+{
+    /* A memo file mapped a few chunks at a time.  The least recently used
+     * chunk is unmapped when another one is needed. */
+    int       fd;
+    size_t    filesize;
+    int       slots;
+    char    **maps;             /* NULL for an empty slot */
+    size_t   *starts;           /* The file offset of each mapping */
+    size_t   *lengths;
+    uint64_t *lastused;
+    uint64_t  clock;
+} MEMOCHUNKS;
+
+typedef struct
+{
+    /* Where the rest of a memo is, for reading it a piece at a time */
+    size_t offset;
+    size_t remaining;
+    size_t wanted;              /* How much to ask for next */
+    int    terminated;          /* A dBase III memo that ends at 0x1A */
+    int    binary;              /* A picture or object, not text */
+} MEMOCURSOR;
+
+typedef struct
+{
+    /* Everything needed to decode a record, shared read-only between
+     * threads */
+    const char     *tablename;
+    const DBFFIELD *fields;
+    const PGFIELD  *pgfields;
+    size_t          fieldcount;
+    size_t          recordlength;
+    const char     *memomap;
+    size_t          memosize;
+    size_t          memoblocksize;
+    int             dbase3memos; /* Memos are 0x1A-terminated */
+    int             memotable;  /* One of the MEMOTABLE styles */
+    MEMOSTREAM     *memostream; /* Used instead of memomap if not NULL */
+    MEMOCHUNKS     *memochunks; /* Likewise */
+    size_t          memopiece;  /* The most to read from a memo at once */
+} DBFTABLE;
+
+typedef struct
+{
+    /* One stream of SQL output and the scratch space needed to write it */
+    FILE     *out;
+    ARENA    *arena;            /* Where the buffers come from, or NULL */
+    char     *escapebuf;        /* STATICBUFFERSIZE + 1 bytes */
+    size_t    escapefill;
+    size_t    escapespaces;     /* Spaces that are only printed if
+				 * something follows them */
+    int       escapestopped;    /* Hit a NUL, which ends the value */
+    uint64_t  rows;
+
+    /* The memos already written to the memo table: a bitmap of block
+     * numbers for MEMOTABLEBLOCK, or an open-addressing set of content
+     * hashes for MEMOTABLEHASH */
+    uint64_t *memoseen;
+    size_t    memoseensize;     /* In words */
+    size_t    memoseencount;    /* Hashes in the set */
+    ARENA     memoseenarena;    /* Where it lives under a memory limit */
+    int64_t  *memoids;          /* Each field's memo id for this record */
+} DBFOUTPUT;
+
+typedef struct
+{
+    /* Set up by the caller */
+    const DBFTABLE *table;
+    const char     *records;    /* The first record of this slice */
+    size_t          recordcount;
+
+    /* Filled in by profileworker */
+    pthread_t       thread;
+    uint64_t        scanned;    /* Records that weren't deleted */
+    COLUMNSTATS    *stats;
+} PROFILEJOB;
+
+typedef struct
+{
+    /* Set up by the caller */
+    const DBFTABLE *table;
+    const char     *records;    /* Every record in the file */
+    const uint32_t *recordnums; /* The ones that hashed to this shard */
+    size_t          recordcount;
+    const char     *createtable; /* The column list */
+    char * const   *indexes;
+    int             indexcount;
+    char           *filename;
+
+    /* Filled in by shardworker */
+    pthread_t       thread;
+    DBFOUTPUT       output;
+} SHARDJOB;
+
+typedef struct
+{
+    /* One sorted run being merged */
+    FILE *file;
+    char *record;               /* The run's smallest unmerged record */
+} SORTRUN;
+
+/* qsort() has no way to pass the sort key along to the comparison
+ * function, so clusterrecords() leaves it here */
+static const DBFTABLE *sorttable;
+static size_t          sortfield;
+
 static void exitwitherror(const char *message, const int systemerror)
 {
     /* Print the given error message to stderr, then exit.  If systemerror
@@ -100,49 +300,115 @@ static void exitwitherror(const char *message, const int systemerror)
     exit(EXIT_FAILURE);
 }
 
-static void safeprintbuf(const char *buf, const size_t inputsize)
+static void *arenaalloc(ARENA *arena, const size_t size, const char *what)
 {
-    /* Print a string, insuring that it's fit for use in a tab-delimited
-     * text file */
-    char       *targetbuf;
-    const char *s;
-    const char *lastchar;
-    char       *t;
-    int         realsize = 0;
+    /* Hand out memory from the arena, or from malloc if there isn't one.
+     * Either way, running out is fatal. */
+    void   *buffer;
+    size_t  rounded = (size + 15) & ~(size_t) 15;
 
-    /* Shortcut for empty strings */
-    if(*buf == '\0') {
-        printf("''");
-	return;
+    if(arena == NULL) {
+	buffer = malloc(size ? size : 1);
+	if(buffer == NULL) {
+	    fprintf(stderr, "Unable to malloc %s: %s\n", what, strerror(errno));
+	    exit(EXIT_FAILURE);
+	}
+	return buffer;
     }
+    if(rounded < size || arena->size - arena->used < rounded) {
+	fprintf(stderr, "There isn't room for %s within the memory limit\n", what);
+	exit(EXIT_FAILURE);
+    }
+    buffer = arena->base + arena->used;
+    arena->used += rounded;
+    return buffer;
+}
 
-    /* Find the rightmost non-space, non-null character */
-    for(s = buf + inputsize - 1; s >= buf; s--) {
-	if(*s != ' ' && *s != '\0') {
-	    break;
-	}
+static void arenafree(ARENA *arena, void *buffer)
+{
+    /* Arena memory only comes back all at once, with arenarelease() */
+    if(arena == NULL) {
+	free(buffer);
     }
+}
 
-    /* If there aren't any non-space characters, skip the output part */
-    if(s < buf) {
-        printf("''");
-	return;
+static size_t arenamark(const ARENA *arena)
+{
+    return arena != NULL ? arena->used : 0;
+}
+
+static void arenarelease(ARENA *arena, const size_t mark)
+{
+    /* Give back everything handed out since arenamark() */
+    if(arena != NULL) {
+	arena->used = mark;
     }
+}
 
-    lastchar = s;
-    realsize = s - buf + 1;
-    if(realsize * 2 < STATICBUFFERSIZE) {
-	targetbuf = staticbuf;
-    } else {
-	targetbuf = malloc(realsize * 2 + 1);
-	if(targetbuf == NULL) {
-	    exitwitherror("Unable to malloc the escape output buffer", 1);
-	}
+static size_t arenaleft(const ARENA *arena)
+{
+    return arena != NULL ? arena->size - arena->used : SIZE_MAX;
+}
+
+static void escapeflush(DBFOUTPUT *output)
+{
+    if(fwrite(output->escapebuf, 1, output->escapefill, output->out) != output->escapefill) {
+	exitwitherror("Unable to write the output", 1);
     }
+    output->escapefill = 0;
+}
+
+static void escapebegin(DBFOUTPUT *output)
+{
+    /* Start printing a value that will arrive in one or more pieces */
+    putc('\'', output->out);
+    output->escapefill = 0;
+    output->escapespaces = 0;
+    output->escapestopped = 0;
+}
+
+static void escapepiece(DBFOUTPUT *output, const char *buf, const size_t length)
+{
+    /* Rewrite invalid characters to their SQL-safe alternatives, insuring
+     * that the value is fit for use in a tab-delimited text file.
+     * Trailing spaces and NULs are left off, and so is everything from
+     * the first NUL on. */
+    const char *s;
+    const char *end = buf + length;
+    char       *t;
 
-    /* Re-write invalid characters to their SQL-safe alternatives */
-    t = targetbuf;
-    for(s = buf; s <= lastchar; s++) {
+    for(s = buf; s < end; s++) {
+	if(output->escapestopped) {
+	    /* Nothing past a NUL is printed, but the spaces before it
+	     * are if the value goes on after it */
+	    if(!output->escapespaces) {
+		return;
+	    }
+	    if(*s == ' ' || *s == '\0') {
+		continue;
+	    }
+	} else if(*s == ' ') {
+	    output->escapespaces++;
+	    continue;
+	} else if(*s == '\0') {
+	    output->escapestopped = 1;
+	    continue;
+	}
+	/* Something follows the spaces, so they belong to the value */
+	for(; output->escapespaces; output->escapespaces--) {
+	    if(output->escapefill == STATICBUFFERSIZE) {
+		escapeflush(output);
+	    }
+	    output->escapebuf[output->escapefill++] = ' ';
+	}
+	if(output->escapestopped) {
+	    /* That was all that was left to print */
+	    return;
+	}
+	if(output->escapefill + 2 > STATICBUFFERSIZE) {
+	    escapeflush(output);
+	}
+	t = output->escapebuf + output->escapefill;
 	switch(*s) {
 	case '\\':
 	    *t++ = '\\';
@@ -163,15 +429,71 @@ static void safeprintbuf(const char *buf, const size_t inputsize)
 	default:
 	    *t++ = *s;
 	}
+	output->escapefill = t - output->escapebuf;
     }
-    *t = '\0';
-    printf("'%s'", targetbuf);
+}
+
+static void escapeend(DBFOUTPUT *output)
+{
+    escapeflush(output);
+    putc('\'', output->out);
+}
+
+/* Both hex digits of every byte value, for writing blobs */
+static const char hexpairs[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static void hexbegin(DBFOUTPUT *output)
+{
+    /* Start printing a blob literal, which escapeend() finishes */
+    fputs("X'", output->out);
+    output->escapefill = 0;
+}
+
+static void hexpiece(DBFOUTPUT *output, const char *buf, size_t length)
+{
+    /* Write bytes as hex digits, copying each byte's pair of digits out
+     * of a table and filling the escape buffer a run at a time */
+    const uint8_t *s = (const uint8_t *) buf;
+    char          *t;
+    size_t         run;
+    size_t         i;
 
-    if(targetbuf != staticbuf) {
-	free(targetbuf);
+    while(length) {
+	run = (STATICBUFFERSIZE - output->escapefill) / 2;
+	if(!run) {
+	    escapeflush(output);
+	    continue;
+	}
+	if(run > length) {
+	    run = length;
+	}
+	t = output->escapebuf + output->escapefill;
+	for(i = 0; i < run; i++) {
+	    memcpy(t + i * 2, hexpairs + s[i] * 2, 2);
+	}
+	output->escapefill += run * 2;
+	s += run;
+	length -= run;
     }
 }
 
+static void safeprintbuf(DBFOUTPUT *output, const char *buf, const size_t inputsize)
+{
+    /* Print a string, insuring that it's fit for use in a tab-delimited
+     * text file */
+    escapebegin(output);
+    escapepiece(output, buf, inputsize);
+    escapeend(output);
+}
+
 /* Endian-specific code.  Define functions to convert input data to the
  * required form depending on the endianness of the host architecture. */
 
@@ -333,3 +655,1829 @@ static double sdouble(const char *buf)
 }
 
 #endif
+
+/* Helpers shared by the record decoder and the profiler */
+
+static int32_t parsememoblocknumber(const char *buf, const int memonumbering)
+{
+    /* Decode the memo block number stored in a 'M' or 'G' field */
+    int32_t blocknumber = 0;
+    int     i;
+
+    if(memonumbering == PACKEDMEMOSTYLE) {
+	return slittleint32_t(buf);
+    }
+    if(memonumbering == UNKNOWNMEMOSTYLE) {
+	return 0;
+    }
+    for(i = 0; i < 10; i++) {
+	if(buf[i] != 32) {
+	    /* I'm unaware of any non-ASCII implementation of XBase. */
+	    blocknumber = blocknumber * 10 + buf[i] - '0';
+	}
+    }
+    return blocknumber;
+}
+
+static size_t findfield(const DBFFIELD *fields, const size_t fieldcount, const char *name)
+{
+    /* Find a column by its (case-insensitive) name, returning fieldcount
+     * if there isn't one */
+    size_t fieldnum;
+
+    for(fieldnum = 0; fieldnum < fieldcount; fieldnum++) {
+	if(fields[fieldnum].type != '0' && !strcasecmp(fields[fieldnum].name, name)) {
+	    break;
+	}
+    }
+    return fieldnum;
+}
+
+static uint64_t hashmore(uint64_t hash, const char *buf, const size_t length)
+{
+    /* Run more bytes through FNV-1a, starting from HASHSEED */
+    size_t i;
+
+    for(i = 0; i < length; i++) {
+	hash ^= (uint8_t) buf[i];
+	hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t hashfinish(uint64_t hash)
+{
+    /* The MurmurHash3 finalizer, so that the high bits are usable for
+     * HyperLogLog bucketing and hash partitioning */
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint64_t hashbuf(const char *buf, const size_t length)
+{
+    return hashfinish(hashmore(HASHSEED, buf, length));
+}
+
+static const char *trimfield(const char *buf, size_t *length)
+{
+    /* Strip leading spaces and trailing spaces and nulls from a field,
+     * returning the new start and updating the length */
+    size_t end = *length;
+
+    while(end && (buf[end - 1] == ' ' || buf[end - 1] == '\0')) {
+	end--;
+    }
+    while(end && *buf == ' ') {
+	buf++;
+	end--;
+    }
+    *length = end;
+    return buf;
+}
+
+static int numericclass(const char *buf, const size_t length)
+{
+    /* Decide whether a trimmed 'N' value is an integer that fits in a
+     * signed 64-bit SQLite INTEGER.  Fractions made only of zeroes, like
+     * "12.00", still count as integers. */
+    const char *s = buf;
+    const char *end = buf + length;
+    uint64_t    value = 0;
+    uint64_t    limit = INT64_MAX;
+    int         digits = 0;
+
+    if(s < end && (*s == '-' || *s == '+')) {
+	if(*s == '-') {
+	    limit += 1;
+	}
+	s++;
+    }
+    for(; s < end && isdigit((unsigned char) *s); s++) {
+	if(value > (limit - (*s - '0')) / 10) {
+	    return NUMERICOVERFLOW;
+	}
+	value = value * 10 + (*s - '0');
+	digits++;
+    }
+    if(s < end && *s == '.') {
+	for(s++; s < end && *s == '0'; s++) {
+	    digits++;
+	}
+    }
+    if(s != end || !digits) {
+	return NUMERICFRACTION;
+    }
+    return NUMERICINTEGER;
+}
+
+static void hlladd(uint8_t *registers, const uint64_t hash)
+{
+    /* Record a hashed value in a HyperLogLog sketch */
+    uint64_t rest = hash << HLLBITS;
+    uint8_t  rank;
+
+    rank = rest ? __builtin_clzll(rest) + 1 : 64 - HLLBITS + 1;
+    if(rank > registers[hash >> (64 - HLLBITS)]) {
+	registers[hash >> (64 - HLLBITS)] = rank;
+    }
+}
+
+static double hllestimate(const uint8_t *registers)
+{
+    /* Turn a HyperLogLog sketch into a cardinality estimate, falling back
+     * to linear counting while many registers are still empty */
+    double sum = 0;
+    double estimate;
+    int    zeroes = 0;
+    int    i;
+
+    for(i = 0; i < HLLREGISTERS; i++) {
+	sum += 1.0 / (double) (1ULL << registers[i]);
+	if(!registers[i]) {
+	    zeroes++;
+	}
+    }
+    estimate = 0.7213 / (1 + 1.079 / HLLREGISTERS) * HLLREGISTERS * HLLREGISTERS / sum;
+    if(estimate <= 2.5 * HLLREGISTERS && zeroes) {
+	estimate = HLLREGISTERS * log((double) HLLREGISTERS / zeroes);
+    }
+    return estimate;
+}
+
+static void *profileworker(void *arg)
+{
+    /* Gather column statistics for one slice of the mapped DBF file */
+    PROFILEJOB     *job = arg;
+    const DBFTABLE *table = job->table;
+    COLUMNSTATS *stats;
+    const char  *record;
+    const char  *value;
+    const char  *memorecord;
+    const char  *t;
+    size_t       recordnum;
+    size_t       fieldnum;
+    size_t       length;
+    size_t       memooffset;
+    int32_t      blocknumber;
+
+    for(recordnum = 0; recordnum < job->recordcount; recordnum++) {
+	record = job->records + recordnum * table->recordlength;
+	/* Skip deleted records */
+	if(record[0] == '*') {
+	    continue;
+	}
+	job->scanned++;
+	for(fieldnum = 0; fieldnum < table->fieldcount; fieldnum++) {
+	    stats = &job->stats[fieldnum];
+	    value = record + table->pgfields[fieldnum].offset;
+	    length = table->fields[fieldnum].length;
+	    switch(table->fields[fieldnum].type) {
+	    case '0':
+		continue;
+	    case 'C':
+	    case 'D':
+	    case 'F':
+	    case 'N':
+		value = trimfield(value, &length);
+		if(length && table->fields[fieldnum].type == 'N' && !stats->nonintegral) {
+		    switch(numericclass(value, length)) {
+		    case NUMERICFRACTION:
+			stats->nonintegral = 1;
+			break;
+		    case NUMERICOVERFLOW:
+			stats->overflow = 1;
+			break;
+		    }
+		}
+		break;
+	    case 'L':
+		if(*value == '?' || *value == ' ') {
+		    length = 0;
+		}
+		break;
+	    case 'T':
+		if(!slittleint64_t(value)) {
+		    length = 0;
+		}
+		break;
+	    case 'G':
+	    case 'M':
+		blocknumber = parsememoblocknumber(value, table->pgfields[fieldnum].memonumbering);
+		if(!blocknumber) {
+		    length = 0;
+		    break;
+		}
+		memooffset = table->memoblocksize * (uint32_t) blocknumber;
+		if(memooffset >= table->memosize) {
+		    stats->badmemos++;
+		    continue;
+		}
+		memorecord = table->memomap + memooffset;
+		if(table->dbase3memos) {
+		    t = memchr(memorecord, 0x1A, table->memosize - memooffset);
+		    if(t == NULL) {
+			stats->badmemos++;
+			continue;
+		    }
+		    value = memorecord;
+		    length = t - memorecord;
+		} else {
+		    if(table->memosize - memooffset < 8 ||
+		       (uint32_t) sbigint32_t(memorecord + 4) > table->memosize - memooffset - 8) {
+			stats->badmemos++;
+			continue;
+		    }
+		    value = memorecord + 8;
+		    length = (uint32_t) sbigint32_t(memorecord + 4);
+		}
+		break;
+	    }
+	    if(!length) {
+		stats->blanks++;
+		continue;
+	    }
+	    if(length > stats->maxlength) {
+		stats->maxlength = length;
+	    }
+	    hlladd(stats->registers, hashbuf(value, length));
+	}
+    }
+    return NULL;
+}
+
+static const char *decompressorfor(const char *filename)
+{
+    /* Recognize gzip and zstd files by their magic numbers, returning the
+     * program that unpacks them, or NULL for an ordinary file */
+    unsigned char magic[4];
+    size_t        magiclength;
+    FILE         *file;
+    struct stat   filestat;
+
+    /* Peeking into a pipe would eat the data */
+    if(stat(filename, &filestat) == -1 || !S_ISREG(filestat.st_mode)) {
+	return NULL;
+    }
+    file = fopen(filename, "rb");
+    if(file == NULL) {
+	return NULL;            /* Let the caller report the real error */
+    }
+    magiclength = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+    if(magiclength >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+	return "gzip";
+    }
+    if(magiclength == 4 && magic[0] == 0x28 && magic[1] == 0xb5 &&
+       magic[2] == 0x2f && magic[3] == 0xfd) {
+	return "zstd";
+    }
+    return NULL;
+}
+
+static int startdecompressor(const char *filename, const char *decompressor, pid_t *pid)
+{
+    /* Run the decompressor as a separate process so that unpacking
+     * overlaps with decoding, returning the read end of its output.  None
+     * of these descriptors may leak into another decompressor, or it would
+     * keep this one's pipe open and neither would ever see it close. */
+    int filefd;
+    int pipefds[2];
+
+    filefd = open(filename, O_RDONLY | O_CLOEXEC);
+    if(filefd == -1) {
+	exitwitherror("Unable to open a compressed file", 1);
+    }
+    if(pipe2(pipefds, O_CLOEXEC) == -1) {
+	exitwitherror("Unable to create a pipe for the decompressor", 1);
+    }
+    *pid = fork();
+    if(*pid == -1) {
+	exitwitherror("Unable to fork the decompressor", 1);
+    }
+    if(!*pid) {
+	if(dup2(filefd, STDIN_FILENO) == -1 || dup2(pipefds[1], STDOUT_FILENO) == -1) {
+	    _exit(127);
+	}
+	close(filefd);
+	close(pipefds[0]);
+	close(pipefds[1]);
+	/* If we stop reading early, the decompressor should die quietly
+	 * of SIGPIPE even when we were started with it ignored */
+	signal(SIGPIPE, SIG_DFL);
+	execlp(decompressor, decompressor, "-dc", (char *) NULL);
+	perror("Unable to run the decompressor");
+	_exit(127);
+    }
+    close(filefd);
+    close(pipefds[1]);
+    return pipefds[0];
+}
+
+static void waitdecompressor(const pid_t pid)
+{
+    /* Reap the decompressor.  It's fine if it died because we stopped
+     * reading early, but not if it failed on its own. */
+    int status;
+
+    if(waitpid(pid, &status, 0) == -1) {
+	exitwitherror("Unable to wait for the decompressor", 1);
+    }
+    if(WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE) {
+	return;
+    }
+    if(!WIFEXITED(status) || WEXITSTATUS(status)) {
+	exitwitherror("The decompressor failed", 0);
+    }
+}
+
+static char *mapstream(const int fd, size_t *size)
+{
+    /* Read everything from a pipe into an anonymous mapping for the
+     * callers that need random access to it */
+    char    *map;
+    size_t   capacity = DECOMPRESSINITIAL;
+    ssize_t  bytesread;
+
+    map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(map == MAP_FAILED) {
+	exitwitherror("Unable to mmap memory for a streamed file", 1);
+    }
+    *size = 0;
+    for(;;) {
+	if(*size == capacity) {
+	    map = mremap(map, capacity, capacity * 2, MREMAP_MAYMOVE);
+	    if(map == MAP_FAILED) {
+		exitwitherror("Unable to grow the memory for a streamed file", 1);
+	    }
+	    capacity *= 2;
+	}
+	bytesread = read(fd, map + *size, capacity - *size);
+	if(bytesread == -1) {
+	    if(errno == EINTR) {
+		continue;
+	    }
+	    exitwitherror("Unable to read a streamed file", 1);
+	}
+	if(!bytesread) {
+	    break;
+	}
+	*size += bytesread;
+    }
+    if(!*size) {
+	exitwitherror("A streamed file is empty", 0);
+    }
+    /* Give back the unused part of the mapping */
+    map = mremap(map, capacity, *size, 0);
+    if(map == MAP_FAILED) {
+	exitwitherror("Unable to shrink the memory for a streamed file", 1);
+    }
+    return map;
+}
+
+static char *mapdecompressed(const char *filename, const char *decompressor, size_t *size)
+{
+    /* Unpack a whole compressed file into anonymous memory */
+    char  *map;
+    pid_t  pid;
+    int    fd;
+
+    fd = startdecompressor(filename, decompressor, &pid);
+    map = mapstream(fd, size);
+    close(fd);
+    waitdecompressor(pid);
+    return map;
+}
+
+static int anonymousfile(const char *failure)
+{
+    /* Open a temporary file in $TMPDIR that nobody else needs to see and
+     * that shouldn't outlive us */
+    const char *tmpdir = getenv("TMPDIR");
+    char       *filename;
+    int         fd;
+
+    if(tmpdir == NULL || !*tmpdir) {
+	tmpdir = "/tmp";
+    }
+    if(asprintf(&filename, "%s/sqlite3-dbf.XXXXXX", tmpdir) < 0) {
+	exitwitherror("Unable to allocate a temporary filename", 1);
+    }
+    fd = mkostemp(filename, O_CLOEXEC);
+    if(fd == -1) {
+	exitwitherror(failure, 1);
+    }
+    unlink(filename);
+    free(filename);
+    return fd;
+}
+
+static int unpackdecompressed(const char *filename, const char *decompressor, ARENA *arena,
+			      size_t *size)
+{
+    /* Unpack a whole compressed file into a temporary file instead of
+     * memory, so that it can be mapped a piece at a time like any other */
+    char    *buffer;
+    size_t   mark = arenamark(arena);
+    size_t   written;
+    ssize_t  bytesread;
+    ssize_t  byteswritten;
+    pid_t    pid;
+    int      fd;
+    int      unpackedfd;
+
+    unpackedfd = anonymousfile("Unable to create a file to unpack into");
+    buffer = arenaalloc(arena, MEMOCHUNKSIZE, "the unpacking buffer");
+    fd = startdecompressor(filename, decompressor, &pid);
+    *size = 0;
+    for(;;) {
+	bytesread = read(fd, buffer, MEMOCHUNKSIZE);
+	if(bytesread == -1) {
+	    if(errno == EINTR) {
+		continue;
+	    }
+	    exitwitherror("Unable to read a streamed file", 1);
+	}
+	if(!bytesread) {
+	    break;
+	}
+	for(written = 0; written < (size_t) bytesread; written += byteswritten) {
+	    byteswritten = write(unpackedfd, buffer + written, bytesread - written);
+	    if(byteswritten == -1) {
+		if(errno == EINTR) {
+		    byteswritten = 0;
+		    continue;
+		}
+		exitwitherror("Unable to write an unpacked file", 1);
+	    }
+	}
+	*size += bytesread;
+    }
+    close(fd);
+    waitdecompressor(pid);
+    arenafree(arena, buffer);
+    arenarelease(arena, mark);
+    if(!*size) {
+	exitwitherror("A streamed file is empty", 0);
+    }
+    return unpackedfd;
+}
+
+static MEMOSTREAM *openmemostream(const int fd, const size_t window, ARENA *arena)
+{
+    /* Start reading an unmappable memo file through a window.  The window
+     * isn't part of the arena, which leaves room for it under the memory
+     * limit, but then it has to stay the size it is. */
+    MEMOSTREAM *stream;
+
+    stream = arenaalloc(arena, sizeof(MEMOSTREAM), "the memo stream");
+    memset(stream, 0, sizeof(MEMOSTREAM));
+    stream->fd = fd;
+    stream->capacity = window;
+    stream->buffer = malloc(stream->capacity);
+    if(stream->buffer == NULL) {
+	exitwitherror("Unable to malloc the memo window", 1);
+    }
+    stream->fixed = arena != NULL;
+    return stream;
+}
+
+static void closememostream(MEMOSTREAM *stream, ARENA *arena)
+{
+    free(stream->buffer);
+    arenafree(arena, stream);
+}
+
+static const char *memostreamfetch(MEMOSTREAM *stream, const size_t offset,
+				   const size_t wanted, size_t *available)
+{
+    /* Make sure that 'wanted' bytes starting at 'offset' are in the window
+     * (or as many as there are before the end of the file), reading
+     * forward and letting the oldest data go as needed.  The pointer is
+     * only good until the next fetch. */
+    size_t  drop;
+    ssize_t bytesread;
+
+    if(offset < stream->start) {
+	exitwitherror("A memo was referenced after it left the memo window; use a seekable memo file", 0);
+    }
+    while(offset + wanted > stream->start + stream->length && !stream->eof) {
+	if(stream->length == stream->capacity) {
+	    /* Keep as much of the past as possible for memos that are
+	     * referenced more than once, but nothing before 'offset' can
+	     * be needed for this fetch */
+	    drop = offset - stream->start;
+	    if(drop > stream->capacity / 2) {
+		drop = stream->capacity / 2;
+	    }
+	    if(drop) {
+		memmove(stream->buffer, stream->buffer + drop, stream->length - drop);
+		stream->start += drop;
+		stream->length -= drop;
+	    } else if(stream->fixed) {
+		exitwitherror("A memo is bigger than the memo window that the memory limit leaves", 0);
+	    } else {
+		/* One memo is bigger than the whole window */
+		stream->capacity = offset + wanted - stream->start;
+		stream->buffer = realloc(stream->buffer, stream->capacity);
+		if(stream->buffer == NULL) {
+		    exitwitherror("Unable to grow the memo window", 1);
+		}
+	    }
+	}
+	bytesread = read(stream->fd, stream->buffer + stream->length, stream->capacity - stream->length);
+	if(bytesread == -1) {
+	    if(errno == EINTR) {
+		continue;
+	    }
+	    exitwitherror("Unable to read the memo file", 1);
+	}
+	if(!bytesread) {
+	    stream->eof = 1;
+	}
+	stream->length += bytesread;
+    }
+    if(offset >= stream->start + stream->length) {
+	*available = 0;
+    } else {
+	*available = stream->start + stream->length - offset;
+    }
+    return stream->buffer + (offset - stream->start);
+}
+
+static MEMOCHUNKS *openmemochunks(const int fd, const size_t filesize, const size_t window,
+				  ARENA *arena)
+{
+    /* Get ready to map a memo file a chunk at a time, with at most
+     * 'window' bytes of it mapped at once */
+    MEMOCHUNKS *chunks;
+
+    chunks = arenaalloc(arena, sizeof(MEMOCHUNKS), "the memo chunk list");
+    chunks->fd = fd;
+    chunks->filesize = filesize;
+    chunks->slots = window / (MEMOCHUNKSIZE);
+    chunks->clock = 0;
+    if(chunks->slots < 2) {
+	exitwitherror("The memory limit is too small to leave room for the memo file", 0);
+    }
+    chunks->maps = arenaalloc(arena, chunks->slots * sizeof(char *), "the memo chunk list");
+    chunks->starts = arenaalloc(arena, chunks->slots * sizeof(size_t), "the memo chunk list");
+    chunks->lengths = arenaalloc(arena, chunks->slots * sizeof(size_t), "the memo chunk list");
+    chunks->lastused = arenaalloc(arena, chunks->slots * sizeof(uint64_t), "the memo chunk list");
+    memset(chunks->maps, 0, chunks->slots * sizeof(char *));
+    memset(chunks->lastused, 0, chunks->slots * sizeof(uint64_t));
+    return chunks;
+}
+
+static void closememochunks(MEMOCHUNKS *chunks, ARENA *arena)
+{
+    int slot;
+
+    for(slot = 0; slot < chunks->slots; slot++) {
+	if(chunks->maps[slot] != NULL && munmap(chunks->maps[slot], chunks->lengths[slot]) == -1) {
+	    exitwitherror("Unable to munmap part of the memofile", 1);
+	}
+    }
+    arenafree(arena, chunks->maps);
+    arenafree(arena, chunks->starts);
+    arenafree(arena, chunks->lengths);
+    arenafree(arena, chunks->lastused);
+    arenafree(arena, chunks);
+}
+
+static const char *memochunkfetch(MEMOCHUNKS *chunks, const size_t offset, size_t *available)
+{
+    /* Map the chunk that 'offset' is in, unless it already is, and say
+     * how much of the file there is from there to the end of the chunk.
+     * The pointer is only good until the next fetch. */
+    size_t start = offset - offset % (MEMOCHUNKSIZE);
+    int    slot;
+    int    victim = 0;
+
+    if(offset >= chunks->filesize) {
+	*available = 0;
+	return NULL;
+    }
+    for(slot = 0; slot < chunks->slots; slot++) {
+	if(chunks->maps[slot] != NULL && chunks->starts[slot] == start) {
+	    break;
+	}
+	if(chunks->lastused[slot] < chunks->lastused[victim]) {
+	    victim = slot;
+	}
+    }
+    if(slot == chunks->slots) {
+	slot = victim;
+	if(chunks->maps[slot] != NULL && munmap(chunks->maps[slot], chunks->lengths[slot]) == -1) {
+	    exitwitherror("Unable to munmap part of the memofile", 1);
+	}
+	chunks->starts[slot] = start;
+	chunks->lengths[slot] = chunks->filesize - start < MEMOCHUNKSIZE ? chunks->filesize - start : MEMOCHUNKSIZE;
+	chunks->maps[slot] = mmap(NULL, chunks->lengths[slot], PROT_READ, MAP_PRIVATE, chunks->fd, start);
+	if(chunks->maps[slot] == MAP_FAILED) {
+	    exitwitherror("Unable to mmap part of the memofile", 1);
+	}
+    }
+    chunks->lastused[slot] = ++chunks->clock;
+    *available = chunks->starts[slot] + chunks->lengths[slot] - offset;
+    return chunks->maps[slot] + (offset - start);
+}
+
+static void skipinput(FILE *file, size_t bytes)
+{
+    /* Move forward in a file, reading and throwing away the data if it's
+     * a pipe that can't seek */
+    char   discard[4096];
+    size_t chunk;
+
+    if(!fseeko(file, bytes, SEEK_CUR)) {
+	return;
+    }
+    if(errno != ESPIPE) {
+	exitwitherror("Unable to seek in the DBF file", 1);
+    }
+    while(bytes) {
+	chunk = bytes < sizeof(discard) ? bytes : sizeof(discard);
+	if(fread(discard, 1, chunk, file) != chunk) {
+	    exitwitherror("Unable to skip forward in the DBF file", 1);
+	}
+	bytes -= chunk;
+    }
+}
+
+static char *mapdbf(const char *dbffilename, const DBFHEADER *dbfheader,
+		    size_t *mapsize, size_t *recordcount)
+{
+    /* Map the whole DBF file for the multithreaded scanners and work out
+     * how many complete records it really holds */
+    int          dbffd;
+    struct stat  dbfstat;
+    char        *dbfmap;
+    const char  *decompressor;
+    size_t       headerlength = littleint16_t(dbfheader->headerlength);
+    size_t       recordlength = littleint16_t(dbfheader->recordlength);
+
+    decompressor = decompressorfor(dbffilename);
+    if(decompressor != NULL) {
+	dbfmap = mapdecompressed(dbffilename, decompressor, mapsize);
+    } else {
+	dbffd = open(dbffilename, O_RDONLY);
+	if(dbffd == -1) {
+	    exitwitherror("Unable to open the DBF file", 1);
+	}
+	if(fstat(dbffd, &dbfstat) == -1) {
+	    exitwitherror("Unable to fstat the DBF file", 1);
+	}
+	dbfmap = mmap(NULL, dbfstat.st_size, PROT_READ, MAP_PRIVATE, dbffd, 0);
+	if(dbfmap == MAP_FAILED) {
+	    exitwitherror("Unable to mmap the DBF file", 1);
+	}
+	close(dbffd);
+	*mapsize = dbfstat.st_size;
+    }
+
+    /* Don't trust the record count in the header past the end of the file */
+    *recordcount = littleint32_t(dbfheader->recordcount);
+    if(*mapsize < headerlength) {
+	*recordcount = 0;
+    } else if(*recordcount > (*mapsize - headerlength) / recordlength) {
+	*recordcount = (*mapsize - headerlength) / recordlength;
+    }
+    return dbfmap;
+}
+
+static COLUMNSTATS *profiletable(const DBFTABLE *table, const char *records,
+				 const size_t recordcount, uint64_t *scanned)
+{
+    /* Profile the columns of the mapped records, handing an even share of
+     * them to each of a bunch of threads and merging their statistics
+     * afterward */
+    PROFILEJOB   jobs[PROFILEMAXTHREADS];
+    COLUMNSTATS *stats;
+    size_t       recordsperjob;
+    long         jobcount;
+    long         job;
+    size_t       fieldnum;
+    int          i;
+
+    jobcount = sysconf(_SC_NPROCESSORS_ONLN);
+    if(jobcount > PROFILEMAXTHREADS) {
+	jobcount = PROFILEMAXTHREADS;
+    }
+    if(jobcount > (long) (recordcount / PROFILEMINRECORDS)) {
+	jobcount = recordcount / PROFILEMINRECORDS;
+    }
+    if(jobcount < 1) {
+	jobcount = 1;
+    }
+    recordsperjob = (recordcount + jobcount - 1) / jobcount;
+
+    for(job = 0; job < jobcount; job++) {
+	memset(&jobs[job], 0, sizeof(PROFILEJOB));
+	jobs[job].table = table;
+	if((size_t) job * recordsperjob < recordcount) {
+	    jobs[job].records = records + job * recordsperjob * table->recordlength;
+	    jobs[job].recordcount = recordcount - job * recordsperjob;
+	    if(jobs[job].recordcount > recordsperjob) {
+		jobs[job].recordcount = recordsperjob;
+	    }
+	}
+	jobs[job].stats = calloc(table->fieldcount, sizeof(COLUMNSTATS));
+	if(jobs[job].stats == NULL) {
+	    exitwitherror("Unable to malloc the column statistics", 1);
+	}
+	if(pthread_create(&jobs[job].thread, NULL, profileworker, &jobs[job])) {
+	    exitwitherror("Unable to start a profiling thread", 0);
+	}
+    }
+
+    /* The first job's statistics become the merged result */
+    stats = jobs[0].stats;
+    *scanned = 0;
+    for(job = 0; job < jobcount; job++) {
+	if(pthread_join(jobs[job].thread, NULL)) {
+	    exitwitherror("Unable to join a profiling thread", 0);
+	}
+	*scanned += jobs[job].scanned;
+	if(!job) {
+	    continue;
+	}
+	for(fieldnum = 0; fieldnum < table->fieldcount; fieldnum++) {
+	    if(jobs[job].stats[fieldnum].maxlength > stats[fieldnum].maxlength) {
+		stats[fieldnum].maxlength = jobs[job].stats[fieldnum].maxlength;
+	    }
+	    stats[fieldnum].blanks += jobs[job].stats[fieldnum].blanks;
+	    stats[fieldnum].nonintegral |= jobs[job].stats[fieldnum].nonintegral;
+	    stats[fieldnum].overflow |= jobs[job].stats[fieldnum].overflow;
+	    stats[fieldnum].badmemos += jobs[job].stats[fieldnum].badmemos;
+	    for(i = 0; i < HLLREGISTERS; i++) {
+		if(jobs[job].stats[fieldnum].registers[i] > stats[fieldnum].registers[i]) {
+		    stats[fieldnum].registers[i] = jobs[job].stats[fieldnum].registers[i];
+		}
+	    }
+	}
+	free(jobs[job].stats);
+    }
+    return stats;
+}
+
+static uint64_t *memoseenalloc(DBFOUTPUT *output, const size_t words)
+{
+    /* Make room for a memo set of the given size next to the current one,
+     * or return NULL if that's more than its share of the memory limit */
+    ARENA *arena = output->arena != NULL ? &output->memoseenarena : NULL;
+
+    if(arena != NULL && arenaleft(arena) < ((words * sizeof(uint64_t) + 15) & ~(size_t) 15)) {
+	return NULL;
+    }
+    return arenaalloc(arena, words * sizeof(uint64_t), "the memo bookkeeping");
+}
+
+static void memoseenreplace(DBFOUTPUT *output, uint64_t *oldseen)
+{
+    /* The new set is in place, so the old one can go.  In the arena that
+     * means moving the new set down over it, which leaves all the room
+     * after it for the next one. */
+    size_t bytes = output->memoseensize * sizeof(uint64_t);
+
+    if(output->arena == NULL) {
+	free(oldseen);
+	return;
+    }
+    memmove(output->memoseenarena.base, output->memoseen, bytes);
+    output->memoseen = (uint64_t *) output->memoseenarena.base;
+    output->memoseenarena.used = 0;
+    arenaalloc(&output->memoseenarena, bytes, "the memo bookkeeping");
+}
+
+static void openoutput(DBFOUTPUT *output, FILE *out, const DBFTABLE *table, ARENA *arena)
+{
+    /* Get an output stream ready for printrecord */
+    output->out = out;
+    output->arena = arena;
+    output->rows = 0;
+    output->escapebuf = arenaalloc(arena, STATICBUFFERSIZE + 1, "the escape buffer");
+    output->memoseen = NULL;
+    output->memoseensize = 0;
+    output->memoseencount = 0;
+    output->memoids = NULL;
+    if(table->memotable == MEMOTABLENONE) {
+	return;
+    }
+    if(table->memotable == MEMOTABLEBLOCK) {
+	output->memoseensize = table->memosize / table->memoblocksize / 64 + 1;
+    } else {
+	output->memoseensize = 1024;
+    }
+    output->memoids = arenaalloc(arena, table->fieldcount * sizeof(int64_t), "the memo bookkeeping");
+    if(arena != NULL) {
+	/* The set gets a share of the arena to itself, so that it can grow
+	 * while a sort holds the rest, and a bitmap for a memo file of a
+	 * known size never needs to grow at all */
+	output->memoseenarena.size = arenaleft(arena) / MEMOSEENSHARE;
+	if(table->memotable == MEMOTABLEBLOCK && table->memosize) {
+	    output->memoseenarena.size = (output->memoseensize * sizeof(uint64_t) + 15) & ~(size_t) 15;
+	}
+	output->memoseenarena.base = arenaalloc(arena, output->memoseenarena.size, "the memo bookkeeping");
+	output->memoseenarena.used = 0;
+    }
+    output->memoseen = memoseenalloc(output, output->memoseensize);
+    if(output->memoseen == NULL) {
+	exitwitherror("There isn't room for the memo bookkeeping within the memory limit", 0);
+    }
+    memset(output->memoseen, 0, output->memoseensize * sizeof(uint64_t));
+}
+
+static void closeoutput(DBFOUTPUT *output)
+{
+    /* Free everything openoutput allocated, but leave the stream alone */
+    arenafree(output->arena, output->escapebuf);
+    if(output->arena == NULL) {
+	free(output->memoseen);
+    }
+    arenafree(output->arena, output->memoids);
+}
+
+static int memoseen(const DBFTABLE *table, DBFOUTPUT *output, const uint64_t id)
+{
+    /* Check whether this output has already written the given memo, and
+     * remember it if not */
+    uint64_t *oldseen;
+    size_t    oldsize;
+    size_t    slot;
+    size_t    i;
+
+    if(table->memotable == MEMOTABLEBLOCK) {
+	if(id / 64 >= output->memoseensize) {
+	    /* The memo file's size isn't always known up front.  Without
+	     * room for a bigger bitmap, the memo is just written again,
+	     * which INSERT OR IGNORE makes harmless. */
+	    oldseen = output->memoseen;
+	    oldsize = output->memoseensize;
+	    output->memoseen = memoseenalloc(output, id / 64 * 2 + 1);
+	    if(output->memoseen == NULL) {
+		output->memoseen = oldseen;
+		return 0;
+	    }
+	    output->memoseensize = id / 64 * 2 + 1;
+	    memcpy(output->memoseen, oldseen, oldsize * sizeof(uint64_t));
+	    memset(output->memoseen + oldsize, 0, (output->memoseensize - oldsize) * sizeof(uint64_t));
+	    memoseenreplace(output, oldseen);
+	}
+	if(output->memoseen[id / 64] & (1ULL << (id % 64))) {
+	    return 1;
+	}
+	output->memoseen[id / 64] |= 1ULL << (id % 64);
+	return 0;
+    }
+
+    /* Ids are hashes (and never zero), so the low bits make a good slot
+     * number and zero can mark an empty slot */
+    for(slot = id & (output->memoseensize - 1); output->memoseen[slot]; slot = (slot + 1) & (output->memoseensize - 1)) {
+	if(output->memoseen[slot] == id) {
+	    return 1;
+	}
+    }
+    output->memoseen[slot] = id;
+    if(++output->memoseencount * 2 < output->memoseensize) {
+	return 0;
+    }
+
+    /* Keep the set at most half full.  Without room for a bigger one,
+     * start over: memos that are forgotten are just written again, which
+     * INSERT OR IGNORE makes harmless. */
+    oldseen = output->memoseen;
+    oldsize = output->memoseensize;
+    output->memoseen = memoseenalloc(output, oldsize * 2);
+    if(output->memoseen == NULL) {
+	output->memoseen = oldseen;
+	memset(output->memoseen, 0, oldsize * sizeof(uint64_t));
+	output->memoseen[id & (oldsize - 1)] = id;
+	output->memoseencount = 1;
+	return 0;
+    }
+    output->memoseensize *= 2;
+    memset(output->memoseen, 0, output->memoseensize * sizeof(uint64_t));
+    for(i = 0; i < oldsize; i++) {
+	if(oldseen[i]) {
+	    for(slot = oldseen[i] & (output->memoseensize - 1); output->memoseen[slot]; slot = (slot + 1) & (output->memoseensize - 1));
+	    output->memoseen[slot] = oldseen[i];
+	}
+    }
+    memoseenreplace(output, oldseen);
+    return 0;
+}
+
+static const char *memofetch(const DBFTABLE *table, const size_t offset, const size_t wanted,
+			     size_t *available)
+{
+    /* Find the memo file's bytes starting at 'offset'.  At least 'wanted'
+     * of them are available unless the end of the file or (for a chunked
+     * memo file) the end of a chunk comes first.  The pointer is only good
+     * until the next fetch. */
+    if(table->memostream != NULL) {
+	return memostreamfetch(table->memostream, offset, wanted, available);
+    }
+    if(table->memochunks != NULL) {
+	return memochunkfetch(table->memochunks, offset, available);
+    }
+    *available = offset < table->memosize ? table->memosize - offset : 0;
+    return table->memomap + offset;
+}
+
+static void memoopen(const DBFTABLE *table, const int32_t memoblocknumber, MEMOCURSOR *cursor)
+{
+    /* Find where a memo's text starts, and how long it is if the memo
+     * file says */
+    const char *piece;
+    char        header[8];
+    size_t      copied;
+    size_t      available;
+
+    cursor->offset = table->memoblocksize * (uint32_t) memoblocknumber;
+    if(table->dbase3memos) {
+	/* Read until the terminator turns up.  These are always text. */
+	cursor->remaining = SIZE_MAX;
+	cursor->wanted = table->memoblocksize;
+	cursor->terminated = 1;
+	cursor->binary = 0;
+	return;
+    }
+    /* The header can straddle two chunks of the memo file */
+    for(copied = 0; copied < sizeof(header); copied += available) {
+	piece = memofetch(table, cursor->offset + copied, sizeof(header) - copied, &available);
+	if(!available) {
+	    exitwitherror("A memo is past the end of the memo file", 0);
+	}
+	if(available > sizeof(header) - copied) {
+	    available = sizeof(header) - copied;
+	}
+	memcpy(header + copied, piece, available);
+    }
+    cursor->offset += sizeof(header);
+    cursor->remaining = (uint32_t) sbigint32_t(header + 4);
+    cursor->wanted = cursor->remaining;
+    cursor->terminated = 0;
+    cursor->binary = sbigint32_t(header) == MEMOPICTURE || sbigint32_t(header) == MEMOOBJECT;
+}
+
+static const char *memonext(const DBFTABLE *table, MEMOCURSOR *cursor, size_t *length)
+{
+    /* Return the next piece of a memo, or NULL once it's all been read.
+     * The piece is only good until the next fetch from the memo file. */
+    const char *piece;
+    const char *t;
+
+    if(!cursor->remaining) {
+	return NULL;
+    }
+    if(cursor->wanted > table->memopiece) {
+	cursor->wanted = table->memopiece;
+    }
+    piece = memofetch(table, cursor->offset, cursor->wanted, length);
+    if(!*length) {
+	if(cursor->terminated) {
+	    /* An unterminated memo runs to the end of the file */
+	    return NULL;
+	}
+	exitwitherror("A memo is past the end of the memo file", 0);
+    }
+    if(*length > cursor->remaining) {
+	*length = cursor->remaining;
+    }
+    if(cursor->terminated) {
+	t = memchr(piece, 0x1A, *length);
+	if(t != NULL) {
+	    *length = t - piece;
+	    cursor->remaining = 0;
+	} else if(cursor->wanted < SIZE_MAX / 2) {
+	    cursor->wanted *= 2;
+	}
+    } else {
+	cursor->remaining -= *length;
+	cursor->wanted = cursor->remaining;
+    }
+    cursor->offset += *length;
+    return piece;
+}
+
+static void printmemo(const DBFTABLE *table, DBFOUTPUT *output, const int32_t memoblocknumber,
+		      const int binary)
+{
+    /* Print a memo a piece at a time, so that a huge memo never has to be
+     * in memory all at once.  Pictures and objects, and anything that the
+     * caller knows is binary, are written as blobs so that they come
+     * through byte for byte. */
+    MEMOCURSOR  cursor;
+    const char *piece;
+    size_t      length;
+
+    memoopen(table, memoblocknumber, &cursor);
+    if(binary || cursor.binary) {
+	hexbegin(output);
+	while((piece = memonext(table, &cursor, &length)) != NULL) {
+	    hexpiece(output, piece, length);
+	}
+    } else {
+	escapebegin(output);
+	while((piece = memonext(table, &cursor, &length)) != NULL) {
+	    escapepiece(output, piece, length);
+	}
+    }
+    escapeend(output);
+}
+
+static void printmemos(const DBFTABLE *table, DBFOUTPUT *output, const char *record)
+{
+    /* Move a record's memos out to the memo table, writing each one only
+     * the first time it's seen, and note the ids the record refers to */
+    MEMOCURSOR  cursor;
+    const char *piece;
+    size_t      length;
+    size_t      fieldnum;
+    int32_t     memoblocknumber;
+    uint64_t    id;
+
+    for(fieldnum = 0; fieldnum < table->fieldcount; fieldnum++) {
+	if(table->fields[fieldnum].type != 'M') {
+	    continue;
+	}
+	memoblocknumber = parsememoblocknumber(record + table->pgfields[fieldnum].offset,
+					       table->pgfields[fieldnum].memonumbering);
+	if(!memoblocknumber) {
+	    output->memoids[fieldnum] = 0;
+	    continue;
+	}
+	if(table->memotable == MEMOTABLEBLOCK) {
+	    id = (uint32_t) memoblocknumber;
+	} else {
+	    memoopen(table, memoblocknumber, &cursor);
+	    id = HASHSEED;
+	    while((piece = memonext(table, &cursor, &length)) != NULL) {
+		id = hashmore(id, piece, length);
+	    }
+	    /* Keep the id a positive SQLite integer */
+	    id = hashfinish(id) & INT64_MAX;
+	    if(!id) {
+		id = 1;
+	    }
+	}
+	output->memoids[fieldnum] = id;
+	if(memoseen(table, output, id)) {
+	    continue;
+	}
+	/* The table may already have it if this is a resumed import */
+	fprintf(output->out, "INSERT OR IGNORE INTO %s_memo VALUES(%jd,", table->tablename, (intmax_t) id);
+	printmemo(table, output, memoblocknumber, 0);
+	fputs(");\n", output->out);
+    }
+}
+
+static size_t formatcurrency(char *buf, const int64_t value)
+{
+    /* Write a currency value, which is stored in ten-thousandths, with its
+     * decimal point */
+    char *s = buf + sprintf(buf, "%05jd", (intmax_t) value);
+
+    *(s + 1) = '\0';
+    *(s) = *(s - 1);
+    *(s - 1) = *(s - 2);
+    *(s - 2) = *(s - 3);
+    *(s - 3) = *(s - 4);
+    *(s - 4) = '.';
+    return s + 1 - buf;
+}
+
+static void printrecord(const DBFTABLE *table, DBFOUTPUT *output, const char *record)
+{
+    /* Print one undeleted record as an INSERT statement */
+    const DBFFIELD *fields = table->fields;
+    const PGFIELD  *pgfields = table->pgfields;
+    FILE           *out = output->out;
+    const char     *bufoffset = record + 1;
+    char           *s;
+    char            outputbuffer[256]; /* Field lengths are a single byte */
+    int32_t         memoblocknumber;
+    size_t          fieldnum;
+
+    /* Datetime calculation stuff */
+    int32_t juliandays;
+    int32_t seconds;
+    int     hours;
+    int     minutes;
+
+    if(table->memotable != MEMOTABLENONE) {
+	printmemos(table, output, record);
+    }
+
+    fprintf(out, "INSERT INTO %s VALUES(", table->tablename);
+    for(fieldnum = 0; fieldnum < table->fieldcount; fieldnum++) {
+	if(fields[fieldnum].type == '0') {
+	    continue;
+	}
+	if(fieldnum) {
+	    putc(',', out);
+	}
+	switch(fields[fieldnum].type) {
+	case 'B':
+	    /* Double floats */
+	    fprintf(out, pgfields[fieldnum].formatstring, sdouble(bufoffset));
+	    break;
+	case 'C':
+	    /* Varchars */
+	    safeprintbuf(output, bufoffset, fields[fieldnum].length);
+	    break;
+	case 'D':
+	    /* Datestamps */
+	    if(bufoffset[0] == ' ' || bufoffset[0] == '\0') {
+		fputs("'\\N'", out);
+	    } else {
+		s = outputbuffer;
+		*s++ = bufoffset[0];
+		*s++ = bufoffset[1];
+		*s++ = bufoffset[2];
+		*s++ = bufoffset[3];
+		*s++ = '-';
+		*s++ = bufoffset[4];
+		*s++ = bufoffset[5];
+		*s++ = '-';
+		*s++ = bufoffset[6];
+		*s++ = bufoffset[7];
+		*s++ = '\0';
+		fprintf(out, "'%s'", outputbuffer);
+	    }
+	    break;
+	case 'G':
+	    /* General binary objects.  Without a memo file there's
+	     * nothing for them to point to. */
+	    memoblocknumber = parsememoblocknumber(bufoffset, pgfields[fieldnum].memonumbering);
+	    if(memoblocknumber && table->memoblocksize) {
+		printmemo(table, output, memoblocknumber, 1);
+	    } else {
+		fputs("NULL", out);
+	    }
+	    break;
+	case 'I':
+	    /* Integers */
+	    fprintf(out, "'%d'", slittleint32_t(bufoffset));
+	    break;
+	case 'L':
+	    /* Booleans */
+	    switch(bufoffset[0]) {
+	    case 'Y':
+	    case 'T':
+		putc('1', out);
+		break;
+	    default:
+		putc('0', out);
+		break;
+	    }
+	    break;
+	case 'M':
+	    /* Memos */
+	    if(table->memotable != MEMOTABLENONE) {
+		/* Just refer to the memo table */
+		if(output->memoids[fieldnum]) {
+		    fprintf(out, "%jd", (intmax_t) output->memoids[fieldnum]);
+		} else {
+		    fputs("NULL", out);
+		}
+		break;
+	    }
+	    memoblocknumber = parsememoblocknumber(bufoffset, pgfields[fieldnum].memonumbering);
+	    if(memoblocknumber) {
+		printmemo(table, output, memoblocknumber, 0);
+	    } else {
+		fputs("NULL", out);
+	    }
+	    break;
+	case 'F':
+	case 'N':
+	    /* Numerics */
+	    strncpy(outputbuffer, bufoffset, fields[fieldnum].length);
+	    outputbuffer[fields[fieldnum].length] = '\0';
+	    /* Strip off *leading* spaces */
+	    s = outputbuffer;
+	    while(*s == ' ') {
+		s++;
+	    }
+	    if(*s == '\0') {
+		fputs("'\\N'", out);
+	    } else {
+		fprintf(out, "'%s'", s);
+	    }
+	    break;
+	case 'T':
+	    /* Timestamps */
+	    juliandays = slittleint32_t(bufoffset);
+	    seconds = (slittleint32_t(bufoffset + 4) + 1) / 1000;
+	    if(!(juliandays || seconds)) {
+		fputs("'\\N'", out);
+	    } else {
+		hours = seconds / 3600;
+		seconds -= hours * 3600;
+		minutes = seconds / 60;
+		seconds -= minutes * 60;
+		fprintf(out, "'J%d %02d:%02d:%02d'", juliandays, hours, minutes, seconds);
+	    }
+	    break;
+	case 'Y':
+	    /* Currency */
+	    formatcurrency(outputbuffer, slittleint64_t(bufoffset));
+	    fputs(outputbuffer, out);
+	    break;
+	};
+	bufoffset += fields[fieldnum].length;
+    }
+    fputs(");\n", out);
+    output->rows++;
+}
+
+static void printpreamble(FILE *out, const DBFTABLE *table, const char *columns,
+			  const int replace)
+{
+    /* Start the transaction and create the tables, replacing any that are
+     * already there or else leaving them be */
+    fprintf(out, "BEGIN;\n");
+    if(replace) {
+	fprintf(out, "DROP TABLE IF EXISTS %s;\n", table->tablename);
+	fprintf(out, "CREATE TABLE %s %s;\n", table->tablename, columns);
+	if(table->memotable != MEMOTABLENONE) {
+	    fprintf(out, "DROP TABLE IF EXISTS %s_memo;\n", table->tablename);
+	    fprintf(out, "CREATE TABLE %s_memo (id INTEGER PRIMARY KEY, body TEXT);\n", table->tablename);
+	}
+    } else {
+	fprintf(out, "CREATE TABLE IF NOT EXISTS %s %s;\n", table->tablename, columns);
+	if(table->memotable != MEMOTABLENONE) {
+	    fprintf(out, "CREATE TABLE IF NOT EXISTS %s_memo (id INTEGER PRIMARY KEY, body TEXT);\n",
+		    table->tablename);
+	}
+    }
+}
+
+static void printindexes(FILE *out, const char *tablename, char * const *indexes,
+			 const int indexcount, const int ifnotexists)
+{
+    /* Generate the indexes.  A resumed import may find that the first run
+     * already built them. */
+    const char *s;
+    int         lastcharwasreplaced = 0;
+    int         i;
+
+    for(i = 0; i < indexcount; i++) {
+	fprintf(out, "CREATE INDEX %s%s_", ifnotexists ? "IF NOT EXISTS " : "", tablename);
+	for(s = indexes[i]; *s; s++) {
+	    if(isalnum(*s)) {
+		putc(*s, out);
+		lastcharwasreplaced = 0;
+	    } else {
+		/* Only output one underscore in a row */
+		if(!lastcharwasreplaced) {
+		    putc('_', out);
+		    lastcharwasreplaced = 1;
+		}
+	    }
+	}
+	fprintf(out, " ON %s(%s);\n", tablename, indexes[i]);
+    }
+}
+
+static size_t printedtext(const DBFTABLE *table, const size_t fieldnum, const char *record,
+			  char *buf)
+{
+    /* Rebuild the text that printrecord writes for any field but a memo,
+     * without the quotes.  buf needs room for every byte of the field
+     * escaped. */
+    const char *value = record + table->pgfields[fieldnum].offset;
+    const char *nul;
+    size_t      length = table->fields[fieldnum].length;
+    size_t      end;
+    size_t      i;
+    char       *t = buf;
+    int32_t     juliandays;
+    int32_t     seconds;
+
+    switch(table->fields[fieldnum].type) {
+    case 'B':
+	end = snprintf(buf, 2 * 256, table->pgfields[fieldnum].formatstring, sdouble(value));
+	return end < 2 * 256 ? end : 2 * 256 - 1;
+    case 'I':
+	return sprintf(buf, "%d", slittleint32_t(value));
+    case 'L':
+	buf[0] = value[0] == 'Y' || value[0] == 'T' ? '1' : '0';
+	return 1;
+    case 'Y':
+	return formatcurrency(buf, slittleint64_t(value));
+    case 'C':
+	/* The value stops at its first NUL, and loses the spaces before
+	 * that if nothing but spaces and NULs come after them */
+	nul = memchr(value, '\0', length);
+	end = nul != NULL ? (size_t) (nul - value) : length;
+	for(i = end; i < length && (value[i] == ' ' || value[i] == '\0'); i++);
+	if(i == length) {
+	    while(end && value[end - 1] == ' ') {
+		end--;
+	    }
+	}
+	for(i = 0; i < end; i++) {
+	    switch(value[i]) {
+	    case '\\':
+		*t++ = '\\';
+		*t++ = '\\';
+		break;
+	    case '\n':
+		*t++ = '\\';
+		*t++ = 'n';
+		break;
+	    case '\r':
+		*t++ = '\\';
+		*t++ = 'r';
+		break;
+	    case '\t':
+		*t++ = '\\';
+		*t++ = 't';
+		break;
+	    default:
+		*t++ = value[i];
+	    }
+	}
+	return t - buf;
+    case 'D':
+	if(value[0] == ' ' || value[0] == '\0') {
+	    break;
+	}
+	memcpy(buf, value, 4);
+	buf[4] = '-';
+	memcpy(buf + 5, value + 4, 2);
+	buf[7] = '-';
+	memcpy(buf + 8, value + 6, 2);
+	return 10;
+    case 'F':
+    case 'N':
+	end = strnlen(value, length);
+	for(i = 0; i < end && value[i] == ' '; i++);
+	if(i == end) {
+	    break;
+	}
+	memcpy(buf, value + i, end - i);
+	return end - i;
+    case 'T':
+	juliandays = slittleint32_t(value);
+	seconds = (slittleint32_t(value + 4) + 1) / 1000;
+	if(!(juliandays || seconds)) {
+	    break;
+	}
+	return sprintf(buf, "J%d %02d:%02d:%02d", juliandays, seconds / 3600,
+		       seconds % 3600 / 60, seconds % 60);
+    }
+    /* Blank values are written as the text \N */
+    buf[0] = '\\';
+    buf[1] = 'N';
+    return 2;
+}
+
+static uint64_t hashfield(const DBFTABLE *table, const char *record, const size_t fieldnum)
+{
+    /* Hash a field's value as it's written to the SQL, so that the query
+     * side can work out the shard from the key it looks up */
+    char text[2 * 256]; /* Field lengths are a single byte */
+
+    return hashbuf(text, printedtext(table, fieldnum, record, text));
+}
+
+static uint32_t *partitionrecords(const DBFTABLE *table, const char *records,
+				  const size_t recordcount, const size_t keyfield,
+				  const int shardcount, size_t *shardstarts)
+{
+    /* Hash every undeleted record's key once and group the record numbers
+     * by shard.  Shard i's records are shardstarts[i] up to
+     * shardstarts[i + 1] in the returned array. */
+    uint8_t  *shardids;
+    uint32_t *recordnums;
+    size_t   *next;
+    size_t    recordnum;
+    int       shard;
+
+    shardids = malloc(recordcount ? recordcount : 1);
+    next = calloc(shardcount + 1, sizeof(size_t));
+    if(shardids == NULL || next == NULL) {
+	exitwitherror("Unable to malloc the shard partitioning", 1);
+    }
+    for(recordnum = 0; recordnum < recordcount; recordnum++) {
+	/* MAXSHARDS fits in a byte, and deleted records aren't counted */
+	if(records[recordnum * table->recordlength] != '*') {
+	    shardids[recordnum] = hashfield(table, records + recordnum * table->recordlength, keyfield) % shardcount;
+	    next[shardids[recordnum] + 1]++;
+	}
+    }
+    for(shard = 0; shard < shardcount; shard++) {
+	next[shard + 1] += next[shard];
+    }
+    memcpy(shardstarts, next, (shardcount + 1) * sizeof(size_t));
+    recordnums = malloc((next[shardcount] ? next[shardcount] : 1) * sizeof(uint32_t));
+    if(recordnums == NULL) {
+	exitwitherror("Unable to malloc the shard partitioning", 1);
+    }
+    for(recordnum = 0; recordnum < recordcount; recordnum++) {
+	if(records[recordnum * table->recordlength] != '*') {
+	    recordnums[next[shardids[recordnum]]++] = recordnum;
+	}
+    }
+    free(shardids);
+    free(next);
+    return recordnums;
+}
+
+static void *shardworker(void *arg)
+{
+    /* Write the records that hashed to this shard into its own SQL file.
+     * Each shard is a complete script for its own database. */
+    SHARDJOB   *job = arg;
+    FILE       *out;
+    size_t      i;
+
+    out = fopen(job->filename, "w");
+    if(out == NULL) {
+	exitwitherror("Unable to open a shard output file", 1);
+    }
+    openoutput(&job->output, out, job->table, NULL);
+
+    printpreamble(job->output.out, job->table, job->createtable, 1);
+    for(i = 0; i < job->recordcount; i++) {
+	printrecord(job->table, &job->output,
+		    job->records + (size_t) job->recordnums[i] * job->table->recordlength);
+    }
+    fprintf(job->output.out, "COMMIT;\n");
+    printindexes(job->output.out, job->table->tablename, job->indexes, job->indexcount, 0);
+
+    if(fclose(job->output.out)) {
+	exitwitherror("Unable to write a shard output file", 1);
+    }
+    closeoutput(&job->output);
+    return NULL;
+}
+
+static int comparetext(const char *a, const size_t alength, const char *b, const size_t blength)
+{
+    /* SQLite's BINARY collation */
+    int result = memcmp(a, b, alength < blength ? alength : blength);
+
+    if(result) {
+	return result;
+    }
+    return (alength > blength) - (alength < blength);
+}
+
+static int numerictext(const char *buf, const size_t length, int64_t *integer, double *real)
+{
+    /* Work out what a column with numeric affinity would store for this
+     * text: 2 for an integer, 1 for a real, or 0 if it stays text */
+    char  number[256];
+    char *end;
+
+    memcpy(number, buf, length);
+    number[length] = '\0';
+    errno = 0;
+    *integer = strtoll(number, &end, 10);
+    while(*end == ' ') {
+	end++;
+    }
+    if(end != number && !*end && !errno) {
+	*real = *integer;
+	return 2;
+    }
+    *real = strtod(number, &end);
+    while(*end == ' ') {
+	end++;
+    }
+    return end != number && !*end;
+}
+
+static int comparekeys(const DBFTABLE *table, const size_t fieldnum,
+		       const char *a, const char *b)
+{
+    /* Order two records by one field the same way that SQLite will order
+     * the converted values, so that the clustered table is in the order of
+     * its index on that column.  Text is compared as printrecord writes
+     * it; numbers come before text in columns with numeric affinity. */
+    const char *avalue = a + table->pgfields[fieldnum].offset;
+    const char *bvalue = b + table->pgfields[fieldnum].offset;
+    size_t      alength;
+    size_t      blength;
+    char        atext[2 * 256]; /* Field lengths are a single byte */
+    char        btext[2 * 256];
+    double      anumber;
+    double      bnumber;
+    int64_t     aint;
+    int64_t     bint;
+    int         aclass;
+    int         bclass;
+
+    switch(table->fields[fieldnum].type) {
+    case 'F':
+    case 'N':
+	/* 'F' columns are NUMERIC, and 'N' columns are TEXT unless
+	 * --optimize made them INTEGER */
+	alength = printedtext(table, fieldnum, a, atext);
+	blength = printedtext(table, fieldnum, b, btext);
+	if(table->fields[fieldnum].type == 'N' && !table->pgfields[fieldnum].integer) {
+	    return comparetext(atext, alength, btext, blength);
+	}
+	aclass = numerictext(atext, alength, &aint, &anumber);
+	bclass = numerictext(btext, blength, &bint, &bnumber);
+	if(!aclass || !bclass) {
+	    if(aclass || bclass) {
+		return aclass ? -1 : 1;
+	    }
+	    return comparetext(atext, alength, btext, blength);
+	}
+	if(aclass == 2 && bclass == 2) {
+	    return (aint > bint) - (aint < bint);
+	}
+	return (anumber > bnumber) - (anumber < bnumber);
+    case 'C':
+    case 'D':
+    case 'T':
+	alength = printedtext(table, fieldnum, a, atext);
+	blength = printedtext(table, fieldnum, b, btext);
+	return comparetext(atext, alength, btext, blength);
+    case 'B':
+	anumber = sdouble(avalue);
+	bnumber = sdouble(bvalue);
+	return (anumber > bnumber) - (anumber < bnumber);
+    case 'I':
+	aint = slittleint32_t(avalue);
+	bint = slittleint32_t(bvalue);
+	return (aint > bint) - (aint < bint);
+    case 'L':
+	aint = *avalue == 'Y' || *avalue == 'T';
+	bint = *bvalue == 'Y' || *bvalue == 'T';
+	return (aint > bint) - (aint < bint);
+    case 'Y':
+	aint = slittleint64_t(avalue);
+	bint = slittleint64_t(bvalue);
+	return (aint > bint) - (aint < bint);
+    default:
+	return memcmp(avalue, bvalue, table->fields[fieldnum].length);
+    }
+}
+
+static int comparerecordpointers(const void *a, const void *b)
+{
+    /* qsort() callback for an array of record pointers.  Ties keep their
+     * original order so that the sort is stable. */
+    const char *arecord = *(const char * const *) a;
+    const char *brecord = *(const char * const *) b;
+    int         result;
+
+    result = comparekeys(sorttable, sortfield, arecord, brecord);
+    if(result) {
+	return result;
+    }
+    return (arecord > brecord) - (arecord < brecord);
+}
+
+static FILE *spillfile(void)
+{
+    /* Open an anonymous temporary file in $TMPDIR for a sorted run */
+    FILE *file;
+    int   fd;
+
+    fd = anonymousfile("Unable to create a spill file");
+    file = fdopen(fd, "w+b");
+    if(file == NULL) {
+	exitwitherror("Unable to open a spill file", 1);
+    }
+    if(setvbuf(file, NULL, _IOFBF, DBFBATCHTARGET)) {
+	exitwitherror("Unable to set the buffer for a spill file", 1);
+    }
+    return file;
+}
+
+static int sortrunless(const DBFTABLE *table, const size_t keyfield,
+		       const SORTRUN *runs, const int a, const int b)
+{
+    /* Heap ordering for the merge: by key, then by run so that the merge
+     * stays stable */
+    int result = comparekeys(table, keyfield, runs[a].record, runs[b].record);
+
+    return result ? result < 0 : a < b;
+}
+
+static void mergeruns(const DBFTABLE *table, const size_t keyfield, FILE **runfiles,
+		      const int runcount, size_t memorybudget, ARENA *arena,
+		      FILE *merged, DBFOUTPUT *output)
+{
+    /* Merge sorted runs of raw records with a binary heap.  The result is
+     * either written to another run file or, if merged is NULL, printed. */
+    SORTRUN *runs;
+    int     *heap;
+    int      heapsize = 0;
+    int      parent;
+    int      child;
+    int      run;
+    int      i;
+    int      fd;
+    size_t   bufsize;
+    size_t   mark = arenamark(arena);
+
+    runs = arenaalloc(arena, runcount * sizeof(SORTRUN), "the merge state");
+    heap = arenaalloc(arena, runcount * sizeof(int), "the merge state");
+    for(run = 0; run < runcount; run++) {
+	runs[run].record = arenaalloc(arena, table->recordlength, "a merge record");
+    }
+    /* Split the memory budget between the runs' read buffers */
+    if(memorybudget > arenaleft(arena)) {
+	memorybudget = arenaleft(arena);
+    }
+    bufsize = memorybudget / (runcount + 1);
+    if(bufsize < table->recordlength) {
+	bufsize = table->recordlength;
+    }
+    for(run = 0; run < runcount; run++) {
+	/* Reopen the finished run for reading so that it can be given a
+	 * bigger buffer */
+	fd = dup(fileno(runfiles[run]));
+	if(fd == -1 || fclose(runfiles[run])) {
+	    exitwitherror("Unable to finish writing a spill file", 1);
+	}
+	if(lseek(fd, 0, SEEK_SET) == -1) {
+	    exitwitherror("Unable to seek in a spill file", 1);
+	}
+	runs[run].file = fdopen(fd, "rb");
+	if(runs[run].file == NULL) {
+	    exitwitherror("Unable to reopen a spill file", 1);
+	}
+	if(setvbuf(runs[run].file, arena != NULL ? arenaalloc(arena, bufsize, "a spill file buffer") : NULL,
+		   _IOFBF, bufsize)) {
+	    exitwitherror("Unable to set the buffer for a spill file", 1);
+	}
+	if(fread(runs[run].record, table->recordlength, 1, runs[run].file) != 1) {
+	    continue;
+	}
+	/* Sift the new run up into place */
+	for(child = heapsize++; child; child = parent) {
+	    parent = (child - 1) / 2;
+	    if(!sortrunless(table, keyfield, runs, run, heap[parent])) {
+		break;
+	    }
+	    heap[child] = heap[parent];
+	}
+	heap[child] = run;
+    }
+
+    while(heapsize) {
+	run = heap[0];
+	if(merged != NULL) {
+	    if(fwrite(runs[run].record, table->recordlength, 1, merged) != 1) {
+		exitwitherror("Unable to write a spill file", 1);
+	    }
+	} else {
+	    printrecord(table, output, runs[run].record);
+	}
+	if(fread(runs[run].record, table->recordlength, 1, runs[run].file) != 1) {
+	    /* This run is used up, so the last one takes its place */
+	    run = heap[--heapsize];
+	}
+	/* Sift it down into place */
+	for(parent = 0; (child = parent * 2 + 1) < heapsize; parent = child) {
+	    if(child + 1 < heapsize && sortrunless(table, keyfield, runs, heap[child + 1], heap[child])) {
+		child++;
+	    }
+	    if(!sortrunless(table, keyfield, runs, heap[child], run)) {
+		break;
+	    }
+	    heap[parent] = heap[child];
+	}
+	if(heapsize) {
+	    heap[parent] = run;
+	}
+    }
+
+    for(i = 0; i < runcount; i++) {
+	fclose(runs[i].file);
+	arenafree(arena, runs[i].record);
+    }
+    arenafree(arena, runs);
+    arenafree(arena, heap);
+    arenarelease(arena, mark);
+}
+
+static void clusterrecords(FILE *dbffile, const size_t recordcount, const DBFTABLE *table,
+			   const size_t keyfield, size_t memorybudget,
+			   DBFOUTPUT *output)
+{
+    /* Print the undeleted records in key order with an external merge
+     * sort.  As many records as fit in the memory budget are sorted at a
+     * time and spilled to a temporary file, then the files are merged. */
+    char   *buffer;
+    char  **pointers;
+    FILE  **runfiles = NULL;
+    FILE  **merging;
+    int     runcount = 0;
+    size_t  capacity;
+    size_t  recordsleft = recordcount;
+    size_t  wanted;
+    size_t  blocksread;
+    size_t  used;
+    size_t  sorted;
+    size_t  i;
+    int     run;
+    ARENA  *arena = output->arena;
+    size_t  mark = arenamark(arena);
+
+    /* Under a memory limit, sort with whatever the rest of the import
+     * leaves, less a little for the allocations' rounding */
+    if(arena != NULL && memorybudget + 32 > arenaleft(arena)) {
+	memorybudget = arenaleft(arena) > 32 ? arenaleft(arena) - 32 : 0;
+    }
+    capacity = memorybudget / (table->recordlength + sizeof(char *));
+    if(capacity < 2) {
+	capacity = 2;
+    }
+    if(capacity > recordcount) {
+	capacity = recordcount ? recordcount : 1;
+    }
+    buffer = arenaalloc(arena, capacity * table->recordlength, "the sort buffer");
+    pointers = arenaalloc(arena, capacity * sizeof(char *), "the sort buffer");
+    sorttable = table;
+    sortfield = keyfield;
+
+    do {
+	/* Fill the buffer, then sort the live records in it */
+	for(used = 0; used < capacity && recordsleft; used += blocksread, recordsleft -= blocksread) {
+	    wanted = capacity - used < recordsleft ? capacity - used : recordsleft;
+	    blocksread = fread(buffer + used * table->recordlength, table->recordlength, wanted, dbffile);
+	    if(blocksread != wanted) {
+		exitwitherror("Unable to read an entire record", ferror(dbffile));
+	    }
+	}
+	sorted = 0;
+	for(i = 0; i < used; i++) {
+	    /* Skip deleted records */
+	    if(buffer[i * table->recordlength] != '*') {
+		pointers[sorted++] = buffer + i * table->recordlength;
+	    }
+	}
+	qsort(pointers, sorted, sizeof(char *), comparerecordpointers);
+
+	if(!runcount && !recordsleft) {
+	    /* Everything fit in memory, so there's nothing to merge */
+	    for(i = 0; i < sorted; i++) {
+		printrecord(table, output, pointers[i]);
+	    }
+	    break;
+	}
+
+	runfiles = realloc(runfiles, (runcount + 1) * sizeof(FILE *));
+	if(runfiles == NULL) {
+	    exitwitherror("Unable to malloc the spill file list", 1);
+	}
+	runfiles[runcount] = spillfile();
+	for(i = 0; i < sorted; i++) {
+	    if(fwrite(pointers[i], table->recordlength, 1, runfiles[runcount]) != 1) {
+		exitwitherror("Unable to write a spill file", 1);
+	    }
+	}
+	runcount++;
+    } while(recordsleft);
+
+    /* The sort buffer's memory goes to the merge instead */
+    arenafree(arena, buffer);
+    arenafree(arena, pointers);
+    arenarelease(arena, mark);
+
+    /* Merge groups of runs until few enough are left to merge at once */
+    while(runcount > SORTMAXRUNS) {
+	merging = runfiles;
+	runfiles = malloc(((runcount + SORTMAXRUNS - 1) / SORTMAXRUNS) * sizeof(FILE *));
+	if(runfiles == NULL) {
+	    exitwitherror("Unable to malloc the spill file list", 1);
+	}
+	for(run = 0; run * SORTMAXRUNS < runcount; run++) {
+	    runfiles[run] = spillfile();
+	    mergeruns(table, keyfield, merging + run * SORTMAXRUNS,
+		      runcount - run * SORTMAXRUNS < SORTMAXRUNS ? runcount - run * SORTMAXRUNS : SORTMAXRUNS,
+		      memorybudget, arena, runfiles[run], NULL);
+	}
+	free(merging);
+	runcount = run;
+    }
+    if(runcount) {
+	mergeruns(table, keyfield, runfiles, runcount, memorybudget, arena, NULL, output);
+    }
+    free(runfiles);
+}
+
+static void printcheckpoint(FILE *out, const char *tablename, const uint64_t nextrecord,
+			    const char *signature)
+{
+    /* Remember how far the import got.  This goes into the same
+     * transaction as the records themselves, so it's exactly as durable as
+     * they are. */
+    fprintf(out, "INSERT OR REPLACE INTO " CHECKPOINTTABLE " VALUES('%s', %ju, '%s');\n",
+	    tablename, (uintmax_t) nextrecord, signature);
+}